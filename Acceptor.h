@@ -0,0 +1,70 @@
+#ifndef SERVER_ACCEPTOR_H
+#define SERVER_ACCEPTOR_H
+
+#include <cstdio>
+#include <memory>
+#include <new>
+#include "Connection.h"
+#include "Controller.h"
+#include "EventLoop.h"
+#include "Tcp.h"
+
+class Acceptor {
+public:
+    // Accepted connections stay on the acceptor's own loop when pool is null,
+    // otherwise they are spread round-robin over the pool.
+    Acceptor(TcpServer *server, EventLoop *loop, EventLoopPool *pool, Controller &controller);
+    ~Acceptor();
+
+    Acceptor(const Acceptor&) = delete;
+    Acceptor& operator=(const Acceptor&) = delete;
+
+    bool start();
+private:
+    TcpServer *server;
+    EventLoop *loop;
+    EventLoopPool *pool;
+    Controller &controller;
+
+    void handleAccept();
+};
+
+Acceptor::Acceptor(TcpServer *server, EventLoop *loop, EventLoopPool *pool, Controller &controller) : server(server), loop(loop), pool(pool), controller(controller) {}
+
+Acceptor::~Acceptor() {}
+
+bool Acceptor::start() {
+    return loop->add(server->getSocketFd(), EPOLLIN, [this](uint32_t) {
+        handleAccept();
+    });
+}
+
+void Acceptor::handleAccept() {
+    while (true) {
+        TcpSocket *client = server->accept();
+        if (client == nullptr) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+                fprintf(stderr, "Error: can't accept the connect request.\n");
+            if (errno == ECONNABORTED || errno == EINTR)
+                continue;
+            return;
+        }
+        EventLoop *target = pool == nullptr ? loop : pool->getNextLoop();
+        std::shared_ptr<Connection> connection;
+        try {
+            connection = std::make_shared<Connection>(client, target, controller);
+        } catch (const std::bad_alloc&) {
+            fprintf(stderr, "Error: can't allocate connection for client socket fd: %d\n", client->getSocketFd());
+            delete client;
+            continue;
+        }
+        if (target == loop)
+            connection->start();
+        else
+            target->queueInLoop([connection]() {
+                connection->start();
+            });
+    }
+}
+
+#endif //SERVER_ACCEPTOR_H
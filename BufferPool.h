@@ -0,0 +1,66 @@
+#ifndef SERVER_BUFFERPOOL_H
+#define SERVER_BUFFERPOOL_H
+
+#include <atomic>
+#include <vector>
+#include "Stats.h"
+
+// Free list of receive buffers of one size class. Each event loop thread
+// owns its pools, so acquire and release never lock.
+template<typename Buffer>
+class BufferPool {
+public:
+    BufferPool(unsigned long maxIdle, std::atomic<long>& inUse, std::atomic<long>& highWater);
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    Buffer* acquire();
+    void release(Buffer *buffer);
+private:
+    unsigned long maxIdle;
+    std::vector<Buffer*> idle;
+    std::atomic<long>& inUse;
+    std::atomic<long>& highWater;
+};
+
+template<typename Buffer>
+BufferPool<Buffer>::BufferPool(unsigned long maxIdle, std::atomic<long>& inUse, std::atomic<long>& highWater) : maxIdle(maxIdle), inUse(inUse), highWater(highWater) {}
+
+template<typename Buffer>
+BufferPool<Buffer>::~BufferPool() {
+    Stats::get().idleRecvBuffers -= idle.size();
+    for (auto buffer : idle)
+        delete buffer;
+}
+
+template<typename Buffer>
+Buffer* BufferPool<Buffer>::acquire() {
+    Buffer *buffer;
+    if (idle.empty()) {
+        buffer = new Buffer();
+    } else {
+        buffer = idle.back();
+        idle.pop_back();
+        --Stats::get().idleRecvBuffers;
+    }
+    Stats::get().updateMax(highWater, ++inUse);
+    return buffer;
+}
+
+template<typename Buffer>
+void BufferPool<Buffer>::release(Buffer *buffer) {
+    if (buffer == nullptr)
+        return;
+    --inUse;
+    buffer->skip(buffer->getOccupancy());
+    if (idle.size() >= maxIdle) {
+        delete buffer;
+        return;
+    }
+    idle.push_back(buffer);
+    ++Stats::get().idleRecvBuffers;
+}
+
+#endif //SERVER_BUFFERPOOL_H
@@ -0,0 +1,33 @@
+#ifndef SERVER_BUFFERVIEW_H
+#define SERVER_BUFFERVIEW_H
+
+#include <string>
+
+// Non-owning view of bytes still held by a receive buffer.
+struct BufferView {
+    const char *data;
+    unsigned long size;
+
+    BufferView();
+    BufferView(const char *d, unsigned long s);
+    explicit BufferView(const std::string& str);
+
+    bool empty() const;
+    std::string toString() const;
+};
+
+BufferView::BufferView() : data(nullptr), size(0) {}
+
+BufferView::BufferView(const char *d, unsigned long s) : data(d), size(s) {}
+
+BufferView::BufferView(const std::string& str) : data(str.data()), size(str.size()) {}
+
+bool BufferView::empty() const {
+    return size == 0;
+}
+
+std::string BufferView::toString() const {
+    return std::string(data, size);
+}
+
+#endif //SERVER_BUFFERVIEW_H
@@ -0,0 +1,88 @@
+#ifndef SERVER_CHUNKCACHE_H
+#define SERVER_CHUNKCACHE_H
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include "Stats.h"
+
+// Blocks of stored files kept in memory for downloads, shared by all event
+// loops. The least recently used blocks are evicted so that the heap held by
+// the cache never exceeds the capacity: each entry is charged for the
+// capacity of its data and key strings plus the nodes that index it. A block
+// still being copied out stays alive through its shared_ptr after eviction.
+class ChunkCache {
+public:
+    explicit ChunkCache(unsigned long capacity);
+
+    ChunkCache(const ChunkCache&) = delete;
+    ChunkCache& operator=(const ChunkCache&) = delete;
+
+    std::shared_ptr<const std::string> get(const std::string& key, int64_t offset);
+    void put(const std::string& key, int64_t offset, const std::shared_ptr<const std::string>& data);
+private:
+    typedef std::pair<std::string, int64_t> Key;
+    struct Entry {
+        Key key;
+        std::shared_ptr<const std::string> data;
+        unsigned long cost;
+    };
+
+    static unsigned long getCost(const std::string& key, const std::string& data);
+
+    std::mutex mutex;
+    unsigned long capacity;
+    unsigned long size;
+    std::list<Entry> entries; // most recently used first
+    std::map<Key, std::list<Entry>::iterator> index;
+};
+
+ChunkCache::ChunkCache(unsigned long capacity) : capacity(capacity), size(0) {}
+
+std::shared_ptr<const std::string> ChunkCache::get(const std::string& key, int64_t offset) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto iter = index.find(Key(key, offset));
+    if (iter == index.end()) {
+        ++Stats::get().chunkCacheMisses;
+        return nullptr;
+    }
+    ++Stats::get().chunkCacheHits;
+    entries.splice(entries.begin(), entries, iter->second);
+    return iter->second->data;
+}
+
+// The key is stored twice, in the list entry and in the index. Nodes are
+// counted with two words of allocator header each.
+unsigned long ChunkCache::getCost(const std::string& key, const std::string& data) {
+    static const unsigned long NODEHEADER = 2 * sizeof(void*);
+    static const unsigned long LISTNODE = sizeof(Entry) + 2 * sizeof(void*) + NODEHEADER;
+    static const unsigned long MAPNODE = sizeof(std::pair<const Key, std::list<Entry>::iterator>) + 4 * sizeof(void*) + NODEHEADER;
+    static const unsigned long SHAREDSTRING = sizeof(std::string) + 2 * sizeof(long) + NODEHEADER;
+    unsigned long keyCost = key.capacity() + 1 + NODEHEADER;
+    return LISTNODE + MAPNODE + SHAREDSTRING + 2 * keyCost + data.capacity() + 1 + NODEHEADER;
+}
+
+void ChunkCache::put(const std::string& key, int64_t offset, const std::shared_ptr<const std::string>& data) {
+    unsigned long cost = getCost(key, *data);
+    if (cost > capacity)
+        return;
+    std::unique_lock<std::mutex> lock(mutex);
+    Key k(key, offset);
+    if (index.find(k) != index.end())
+        return;
+    while (size + cost > capacity) {
+        size = size - entries.back().cost;
+        index.erase(entries.back().key);
+        entries.pop_back();
+    }
+    entries.push_front(Entry{k, data, cost});
+    index.emplace(k, entries.begin());
+    size = size + cost;
+    Stats::get().chunkCacheBytes = size;
+}
+
+#endif //SERVER_CHUNKCACHE_H
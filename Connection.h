@@ -0,0 +1,346 @@
+#ifndef SERVER_CONNECTION_H
+#define SERVER_CONNECTION_H
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include "Constant.h"
+#include "BufferPool.h"
+#include "Controller.h"
+#include "EventLoop.h"
+#include "MirroredReadRingBuffer.h"
+#include "ReadRingBuffer.h"
+#include "Stats.h"
+#include "Tcp.h"
+
+class Connection : public std::enable_shared_from_this<Connection> {
+public:
+    Connection(TcpSocket *client, EventLoop *loop, Controller &controller);
+    ~Connection();
+
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    TcpSocket* getClient() const;
+    EventLoop* getLoop() const;
+
+    void start();
+private:
+    typedef std::conditional<MIRROREDRECVBUFFER, MirroredReadRingBuffer<SMALLRECVBUFFERSIZE>, ReadRingBuffer<SMALLRECVBUFFERSIZE>>::type SmallRecvBuffer;
+    typedef std::conditional<MIRROREDRECVBUFFER, MirroredReadRingBuffer<RECVBUFFERSIZE>, ReadRingBuffer<RECVBUFFERSIZE>>::type LargeRecvBuffer;
+
+    TcpSocket *client;
+    EventLoop *loop;
+    Controller &controller;
+    // At most one of them is held, and only while unparsed bytes are buffered.
+    SmallRecvBuffer *smallBuffer;
+    LargeRecvBuffer *largeBuffer;
+    Controller::StreamingRequest stream;
+    bool streaming;
+    bool streamChecked;
+    bool closed;
+    bool readPaused;
+    uint32_t events;
+
+    static BufferPool<SmallRecvBuffer>& getSmallPool();
+    static BufferPool<LargeRecvBuffer>& getLargePool();
+
+    void handleEvent(uint32_t events);
+    void handleRead();
+    void handleRequests();
+    template<typename Buffer>
+    void handleRequests(Buffer& buffer);
+    void endStreaming();
+    void pauseIfBacklogged();
+    bool resumeIfDrained();
+    void handleDiskDrain();
+    void handleWrite();
+    void handleClose();
+    void updateEvents();
+    bool growBuffer();
+    void releaseIdleBuffer();
+};
+
+Connection::Connection(TcpSocket *client, EventLoop *loop, Controller &controller) : client(client), loop(loop), controller(controller), smallBuffer(nullptr), largeBuffer(nullptr), streaming(false), streamChecked(false), closed(false), readPaused(false), events(EPOLLIN | EPOLLRDHUP) {}
+
+// Disk pool jobs that outlive the connection only compare the socket's
+// address and id against the open clients, so it can go with it.
+Connection::~Connection() {
+    delete smallBuffer;
+    delete largeBuffer;
+    delete client;
+}
+
+BufferPool<Connection::SmallRecvBuffer>& Connection::getSmallPool() {
+    static thread_local BufferPool<SmallRecvBuffer> pool(RECVBUFFERPOOLIDLE, Stats::get().smallRecvBuffers, Stats::get().smallRecvBuffersHighWater);
+    return pool;
+}
+
+BufferPool<Connection::LargeRecvBuffer>& Connection::getLargePool() {
+    static thread_local BufferPool<LargeRecvBuffer> pool(RECVBUFFERPOOLIDLE, Stats::get().largeRecvBuffers, Stats::get().largeRecvBuffersHighWater);
+    return pool;
+}
+
+TcpSocket* Connection::getClient() const {
+    return client;
+}
+
+EventLoop* Connection::getLoop() const {
+    return loop;
+}
+
+void Connection::start() {
+    fprintf(stderr, "Connect to client %s:%u, client socket fd: %d\n", client->getIP(), client->getport(), client->getSocketFd());
+    std::weak_ptr<Connection> weak = shared_from_this();
+    EventLoop *l = loop;
+    client->setOutboundLimit(OUTBOUNDDROPLIMIT);
+    client->setWriteNotifier([weak, l]() {
+        l->queueInLoop([weak]() {
+            std::shared_ptr<Connection> self = weak.lock();
+            if (self)
+                self->handleWrite();
+        });
+    });
+    client->getDiskBacklog()->setNotifier([weak, l]() {
+        l->queueInLoop([weak]() {
+            std::shared_ptr<Connection> self = weak.lock();
+            if (self)
+                self->handleDiskDrain();
+        });
+    });
+    ++Stats::get().connections;
+    controller.handleClientOpen(client);
+    std::shared_ptr<Connection> self = shared_from_this();
+    if (!loop->add(client->getSocketFd(), events, [self](uint32_t events) {
+        self->handleEvent(events);
+    })) {
+        fprintf(stderr, "Error: can't watch client socket fd: %d\n", client->getSocketFd());
+        handleClose();
+    }
+}
+
+void Connection::handleEvent(uint32_t events) {
+    if (events & (EPOLLHUP | EPOLLERR)) {
+        handleClose();
+        return;
+    }
+    if (events & EPOLLOUT)
+        handleWrite();
+    if (events & (EPOLLIN | EPOLLRDHUP))
+        handleRead();
+}
+
+void Connection::handleRead() {
+    while (!closed && !readPaused) {
+        // Nothing of the streamed body is buffered and the pipe has room, so
+        // the rest can skip user space. Otherwise it goes through the buffer.
+        if (streaming && stream.splice && stream.pipe->getFree() > 0 && smallBuffer == nullptr && largeBuffer == nullptr) {
+            ssize_t len = controller.handleStreamingSplice(stream, client);
+            if (len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                handleClose();
+                return;
+            }
+            if (len < 0 && stream.splice && stream.pipe->getFree() > 0)
+                break;
+            if (stream.remaining == 0)
+                endStreaming();
+            pauseIfBacklogged();
+            continue;
+        }
+        if (smallBuffer == nullptr && largeBuffer == nullptr) {
+            try {
+                smallBuffer = getSmallPool().acquire();
+            } catch (const std::bad_alloc&) {
+                fprintf(stderr, "Error: can't allocate receive buffer for client socket fd: %d\n", client->getSocketFd());
+                handleClose();
+                return;
+            }
+        }
+        if ((smallBuffer ? smallBuffer->getCapacity() : largeBuffer->getCapacity()) == 0) {
+            fprintf(stderr, "Error: request from client socket fd: %d exceeds the receive buffer.\n", client->getSocketFd());
+            handleClose();
+            return;
+        }
+        // Replies queued by the last pass go out with this read.
+        ssize_t len = smallBuffer ? client->flushAndReadInto(*smallBuffer) : client->flushAndReadInto(*largeBuffer);
+        if (len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            handleClose();
+            return;
+        }
+        if (len < 0)
+            break;
+        handleRequests();
+    }
+    releaseIdleBuffer();
+}
+
+void Connection::handleRequests() {
+    if (smallBuffer) {
+        handleRequests(*smallBuffer);
+        if (!closed && !growBuffer())
+            return;
+    }
+    if (largeBuffer)
+        handleRequests(*largeBuffer);
+    releaseIdleBuffer();
+}
+
+template<typename Buffer>
+void Connection::handleRequests(Buffer& buffer) {
+    while (!closed && !readPaused) {
+        if (streaming) {
+            unsigned long n = std::min(buffer.getOccupancy(), stream.remaining);
+            if (n > 0) {
+                std::string scratch;
+                controller.handleStreamingData(stream, buffer.getView(0, n, scratch));
+                buffer.skip(n);
+            }
+            if (stream.remaining > 0) {
+                pauseIfBacklogged();
+                return;
+            }
+            endStreaming();
+        } else if (Controller::havaEntireRequest(buffer)) {
+            streamChecked = false;
+            controller.handleEntireRequest(buffer, client);
+        } else if (!streamChecked && Controller::haveEntireHeader(buffer)) {
+            // The header of a pending frame is parsed once to see if it can stream.
+            streamChecked = true;
+            streaming = controller.beginStreamingRequest(buffer, stream, client);
+            continue;
+        } else {
+            return;
+        }
+        pauseIfBacklogged();
+    }
+}
+
+void Connection::endStreaming() {
+    streaming = false;
+    streamChecked = false;
+    controller.endStreamingRequest(stream, client);
+}
+
+void Connection::pauseIfBacklogged() {
+    if (!readPaused && (client->getOutboundBytes() > OUTBOUNDHIGHWATERMARK || client->getDiskBacklog()->getBytes() > DISKHIGHWATERMARK)) {
+        readPaused = true;
+        ++Stats::get().pausedClients;
+        client->getDiskBacklog()->notifyWhenLow();
+        updateEvents();
+    }
+}
+
+// Reads resume once both the outbound queue and the upload bytes still
+// queued for the disk pool are back under their low watermarks. While the
+// disk is behind, its jobs call handleDiskDrain() when they catch up.
+bool Connection::resumeIfDrained() {
+    if (!readPaused || client->getOutboundBytes() > OUTBOUNDLOWWATERMARK || client->getDiskBacklog()->notifyWhenLow())
+        return false;
+    readPaused = false;
+    --Stats::get().pausedClients;
+    return true;
+}
+
+void Connection::handleDiskDrain() {
+    if (closed || !resumeIfDrained())
+        return;
+    handleRequests();
+    if (closed)
+        return;
+    updateEvents();
+}
+
+// Moves the buffered bytes into a large buffer once the pending frame can't
+// fit in the small one and can't be streamed either. That is only known once
+// its header was looked at, so a partial header waits for more bytes while
+// they fit, and a frame left behind by a pause waits for the resume.
+bool Connection::growBuffer() {
+    if (smallBuffer == nullptr || streaming || readPaused || (!streamChecked && smallBuffer->getCapacity() > 0) || smallBuffer->getOccupancy() < sizeof(uint32_t) ||
+        smallBuffer->lookAheadUInt32LE() + sizeof(uint32_t) <= smallBuffer->getSize())
+        return true;
+    if (smallBuffer->lookAheadUInt32LE() + sizeof(uint32_t) > RECVBUFFERSIZE) {
+        fprintf(stderr, "Error: request from client socket fd: %d exceeds the receive buffer.\n", client->getSocketFd());
+        handleClose();
+        return false;
+    }
+    try {
+        largeBuffer = getLargePool().acquire();
+    } catch (const std::bad_alloc&) {
+        fprintf(stderr, "Error: can't allocate receive buffer for client socket fd: %d\n", client->getSocketFd());
+        handleClose();
+        return false;
+    }
+    std::string scratch;
+    BufferView data = smallBuffer->getView(0, smallBuffer->getOccupancy(), scratch);
+    largeBuffer->putCharArray(const_cast<char*>(data.data), data.size);
+    getSmallPool().release(smallBuffer);
+    smallBuffer = nullptr;
+    return true;
+}
+
+void Connection::releaseIdleBuffer() {
+    if (smallBuffer && smallBuffer->getOccupancy() == 0) {
+        getSmallPool().release(smallBuffer);
+        smallBuffer = nullptr;
+    }
+    if (largeBuffer && largeBuffer->getOccupancy() == 0) {
+        getLargePool().release(largeBuffer);
+        largeBuffer = nullptr;
+    }
+}
+
+void Connection::handleWrite() {
+    if (closed)
+        return;
+    if (!client->flush() || client->isDropped()) {
+        if (client->isDropped())
+            fprintf(stderr, "Drop slow client socket fd: %d\n", client->getSocketFd());
+        handleClose();
+        return;
+    }
+    if (client->getOutboundBytes() < DOWNLOADQUEUEBYTES && client->takeDrainWanted())
+        controller.handleClientDrain(client);
+    if (resumeIfDrained()) {
+        handleRequests();
+        if (closed)
+            return;
+    }
+    if (!client->hasOutbound() && client->isShutdownPending())
+        client->shutdown();
+    updateEvents();
+}
+
+void Connection::updateEvents() {
+    if (closed)
+        return;
+    uint32_t e = (readPaused ? 0u : static_cast<uint32_t>(EPOLLIN | EPOLLRDHUP)) | (client->hasOutbound() ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+    if (e != events) {
+        events = e;
+        loop->modify(client->getSocketFd(), events);
+    }
+}
+
+void Connection::handleClose() {
+    if (closed)
+        return;
+    closed = true;
+    if (readPaused)
+        --Stats::get().pausedClients;
+    --Stats::get().connections;
+    if (streaming)
+        controller.abortStreamingRequest(stream);
+    streaming = false;
+    controller.handleClientClose(client);
+    fprintf(stderr, "Client disconnected.\n");
+    client->clearOutbound();
+    loop->remove(client->getSocketFd());
+    client->close();
+    getSmallPool().release(smallBuffer);
+    getLargePool().release(largeBuffer);
+    smallBuffer = nullptr;
+    largeBuffer = nullptr;
+}
+
+#endif //SERVER_CONNECTION_H
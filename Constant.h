@@ -4,9 +4,47 @@
 #include <cstdint>
 
 const uint16_t PORT = 8053;
-const int MAXCLIENTNUM = 20;
+const int MAXCLIENTNUM = 1024;
+const unsigned int EVENTLOOPNUM = 0; // 0: one event loop per hardware thread
+const bool REUSEPORTLISTENERS = true; // one SO_REUSEPORT listener and accept loop per event loop
+
+// Receive buffers are lent from per-loop pools only while a connection has
+// unparsed bytes: small ones for control frames, large ones for file chunks.
+const unsigned long SMALLRECVBUFFERSIZE = 16384;
+const unsigned long RECVBUFFERSIZE = 131072;
+const unsigned long RECVBUFFERPOOLIDLE = 64; // idle buffers kept per size class and loop
+const bool MIRROREDRECVBUFFER = true; // memfd-backed ring mapped twice, see MirroredReadRingBuffer
+
+// Outbound queue per connection: reads pause above the high watermark and
+// resume below the low one; a client whose queue passes the drop limit is
+// disconnected.
+const unsigned long OUTBOUNDHIGHWATERMARK = 4 * 1024 * 1024;
+const unsigned long OUTBOUNDLOWWATERMARK = 1024 * 1024;
+const unsigned long OUTBOUNDDROPLIMIT = 64 * 1024 * 1024;
+
+const int STATSINTERVAL = 10000;
+
+const bool USEIOURING = true; // falls back to blocking syscalls when the kernel lacks io_uring
+const unsigned int DISKTHREADNUM = 4; // file reads and writes run on these threads, outside the Controller lock
+// Upload bytes per connection still queued for the disk threads: reads pause
+// above the high watermark and resume below the low one, like the outbound
+// queue.
+const unsigned long DISKHIGHWATERMARK = 4 * 1024 * 1024;
+const unsigned long DISKLOWWATERMARK = 1024 * 1024;
 
 const int FILEBLOCKSIZE = 65536;
+const bool ZEROCOPYDOWNLOAD = true; // download bodies go from the file to the socket with sendfile(), except stored files while the chunk cache is on
+const bool PREALLOCATEUPLOAD = true; // fallocate() uploads to their declared size at the start op
+const bool SPLICEUPLOAD = true; // streamed upload bodies go from the socket to the file with splice()
+const unsigned long DOWNLOADQUEUEBYTES = 512 * 1024; // windowed downloads push chunks while less is queued
+const int64_t FILERANGEMAXSIZE = 4 * 1024 * 1024; // longest body of one RECEIVEFILERANGEOP response
+const bool NOTIFYUPLOADSTART = true; // tell an online recipient about a file when its upload starts
+const bool DEDUPSTORE = true; // finished uploads are kept once per SHA-256 of their content
+// Stored files are spread over these directories, e.g. one per disk, each
+// with two levels of hex subdirectories.
+const char * const STOREROOTS[] = {"store"};
+const bool UPLOADCHECKSUM = true; // uploads keep a CRC32C of their bytes, checked at the End op
+const unsigned long CHUNKCACHEBYTES = 64 * 1024 * 1024; // downloads copied out of stored files share a cache this big, 0 to disable
 
 // Request op
 const int REGISTEROP = 0;
@@ -23,6 +61,10 @@ const int RECEIVEFILEOP = 10;
 const int RECEIVEFILEDATASTARTOP = 11;
 const int RECEIVEFILEDATAOP = 12;
 const int RECEIVEFILEDATAENDOP = 13;
+const int RECEIVEFILEDATACREDITOP = 14;
+const int FILEOFFSETOP = 15;
+const int RECEIVEFILERANGEOP = 16;
+const int FILEUPLOADINGOP = 17;
 
 // Public status
 const int SUCCESS = 0;
@@ -35,4 +77,16 @@ const int USERNAMENOTEXIST = 2;
 const int PASSWORDWRONG = 3;
 const int ALREADYLOGIN = 4;
 
+// Send file data status
+const int OFFSETMISMATCH = 5;
+
+// File offset status
+const int FILENOTEXIST = 6;
+
+// Send file data start status
+const int FILEEXIST = 7;
+
+// Send file data end status
+const int CHECKSUMMISMATCH = 8;
+
 #endif //SERVER_CONST_H
@@ -1,11 +1,24 @@
 #ifndef SERVER_CONTROLLER_H
 #define SERVER_CONTROLLER_H
 
+#include <algorithm>
 #include <ctime>
 #include <fstream>
+#include <iterator>
 #include <mutex>
+#include <set>
 #include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "ChunkCache.h"
+#include "Crc32c.h"
+#include "DiskPool.h"
+#include "File.h"
+#include "FileStore.h"
+#include "IoBackend.h"
+#include "MirroredReadRingBuffer.h"
 #include "ReadRingBuffer.h"
+#include "Sha256.h"
 #include "Tcp.h"
 #include "UserInfo.h"
 #include "JsonWritter.h"
@@ -23,15 +36,60 @@
 
 class Controller {
 public:
+    // Running hash and checksum of an upload while its bytes arrive in order.
+    // Once a chunk is missed hashed is -1, and the file is read back at the
+    // End op.
+    struct UploadHash {
+        Sha256 sha;
+        uint32_t crc;
+        int64_t hashed;
+        UploadHash() : crc(0), hashed(0) {}
+        void update(const void *data, unsigned long n, int64_t offset);
+    };
+
+    // Body of a frame that is handed over piece by piece as it arrives,
+    // instead of being buffered whole first.
+    struct StreamingRequest {
+        int action;
+        std::string uuid;
+        std::string fileuuid;
+        int64_t offset;
+        unsigned long remaining;
+        std::shared_ptr<File> file;
+        // Body bytes may bypass the receive buffer and be spliced into file
+        // through pipe.
+        bool splice;
+        std::shared_ptr<SplicePipe> pipe;
+        // A chunk at the wrong offset is read off the socket and dropped.
+        bool accepted;
+        int64_t transfer;
+        std::shared_ptr<UploadHash> hash;
+        std::shared_ptr<DiskBacklog> backlog;
+        StreamingRequest() : action(-1), offset(0), remaining(0), splice(false), accepted(false), transfer(0) {}
+    };
+
     Controller();
     ~Controller();
 
     static std::string createUUID();
-    template<unsigned long SIZE>
-    static bool havaEntireRequest(const ReadRingBuffer<SIZE>&);
+    template<typename Buffer>
+    static bool havaEntireRequest(const Buffer&);
+    template<typename Buffer>
+    static bool haveEntireHeader(const Buffer&);
+
+    template<typename Buffer>
+    bool handleEntireRequest(Buffer&, TcpSocket*);
+
+    template<typename Buffer>
+    bool beginStreamingRequest(Buffer&, StreamingRequest&, TcpSocket*);
+
+    bool handleStreamingData(StreamingRequest&, const BufferView& data);
+
+    ssize_t handleStreamingSplice(StreamingRequest&, TcpSocket*);
 
-    template<unsigned long SIZE>
-    bool handleEntireRequest(ReadRingBuffer<SIZE>&, TcpSocket*);
+    bool endStreamingRequest(StreamingRequest&, TcpSocket*);
+
+    void abortStreamingRequest(StreamingRequest&);
 
     bool handleRegisterRequest(const std::string& uuid, const std::string& username, const std::string& password, TcpSocket*);
 
@@ -47,17 +105,27 @@ public:
 
     bool handleSendFileRequest(const std::string& uuid, FileInfo& file, TcpSocket*);
 
-    bool handleSendFileDataStartRequest(const std::string& uuid, const std::string& fileuuid, const int64_t size, TcpSocket*);
+    bool handleSendFileDataStartRequest(const std::string& uuid, int64_t transfer, const std::string& fileuuid, const int64_t size, int64_t offset, int64_t ackInterval, const std::string& hash, TcpSocket*);
+
+    bool handleSendFileDataRequest(const std::string& uuid, int64_t transfer, const std::string& fileuuid, int64_t offset, const int64_t size, const BufferView& filedata, TcpSocket*);
+
+    bool handleSendFileDataEndRequest(const std::string& uuid, int64_t transfer, int64_t crc, TcpSocket*);
+
+    bool handleReceiveFileDataStartRequest(const std::string& uuid, int64_t transfer, const std::string& fileuuid, int64_t offset, int64_t length, int64_t window, bool follow, TcpSocket*);
 
-    bool handleSendFileDataRequest(const std::string& uuid, const std::string& fileuuid, const int64_t size, const std::string& filedata, TcpSocket*);
+    bool handleReceiveFileDataRequest(const std::string& uuid, int64_t transfer, TcpSocket*);
 
-    bool handleSendFileDataEndRequest(const std::string& uuid, TcpSocket*);
+    bool handleReceiveFileDataEndRequest(const std::string& uuid, int64_t transfer, TcpSocket*);
 
-    bool handleReceiveFileDataStartRequest(const std::string& uuid, const std::string& fileuuid, TcpSocket*);
+    bool handleReceiveFileDataCreditRequest(const std::string& uuid, int64_t transfer, int64_t credit, TcpSocket*);
 
-    bool handleReceiveFileDataRequest(const std::string& uuid, TcpSocket*);
+    bool handleFileOffsetRequest(const std::string& uuid, const std::string& fileuuid, TcpSocket*);
 
-    bool handleReceiveFileDataEndRequest(const std::string& uuid, TcpSocket*);
+    bool handleReceiveFileRangeRequest(const std::string& uuid, const std::string& fileuuid, int64_t offset, int64_t length, TcpSocket*);
+
+    bool handleClientDrain(TcpSocket*);
+
+    bool handleClientOpen(TcpSocket*);
 
     bool handleClientClose(TcpSocket*);
 
@@ -67,21 +135,85 @@ public:
 private:
     struct FileClientInfo {
         std::string fileuuid;
+        int64_t transfer; // 0 unless the client multiplexes transfers
         bool isUpload;
-        FileClientInfo(std::string f, bool i) : fileuuid(f), isUpload(i) {}
+        std::shared_ptr<File> file; // open for the whole transfer
+        int64_t offset; // download cursor
+        int64_t end; // download stops here
+        bool follow; // download waits for bytes still being uploaded
+        // Windowed download: chunks are pushed without requests while the
+        // client has granted credit (bytes).
+        bool windowed;
+        int64_t credit;
+        std::string uuid;
+        // Pipelined upload: chunks carry their offset and are acknowledged
+        // together once ackInterval bytes past the last ack are written.
+        bool pipelined;
+        int64_t ackInterval;
+        int64_t acked;
+        std::shared_ptr<UploadHash> hash; // set for uploads going to the store
+        bool ending; // the End op waits for the disk pool
+        FileClientInfo(std::string f, int64_t t, bool i, const std::shared_ptr<File>& file) : fileuuid(f), transfer(t), isUpload(i), file(file), offset(0), end(0), follow(false),
+                                                                                              windowed(false), credit(0), pipelined(false), ackInterval(0), acked(0), ending(false) {}
+    };
+
+    struct ClientTransferInfo {
+        std::map<int64_t, FileClientInfo> transfers; // key: transfer id
+        int64_t nextPush; // windowed downloads are served round-robin from here
+        int64_t pending; // download bytes the disk pool has yet to hand over
+        ClientTransferInfo() : nextPush(0), pending(0) {}
     };
 
+    static void addTransferMember(JsonWritter&, int64_t transfer);
+    bool isOpen(TcpSocket*, uint64_t id);
+    FileClientInfo* findTransfer(TcpSocket*, int64_t transfer);
+    FileClientInfo* findTransfer(TcpSocket*, int64_t transfer, const std::string& fileuuid);
+    FileClientInfo& addTransfer(TcpSocket*, FileClientInfo&& info);
+    void removeTransfer(TcpSocket*, int64_t transfer);
+    void unfollow(const FileClientInfo&, TcpSocket*);
+    void notifyFollowers(const std::string& fileuuid);
+    int64_t getDownloadLimit(const FileClientInfo&, const FileInfo&);
+    void endTransfer(int action, const std::string& uuid, int64_t transfer, TcpSocket*);
+    std::shared_ptr<File> getTransferFile(FileClientInfo*, const std::string& fileuuid, int flags);
+    std::string getFilePath(const std::string& fileuuid, const FileInfo&);
+    void scanStore();
+    static bool isLegacyName(const std::string& fileuuid);
+    static std::shared_ptr<UploadHash> finishUploadHash(const std::string& path, std::shared_ptr<UploadHash> hash, int64_t size);
+    void storeFile(const std::string& fileuuid, const std::shared_ptr<File>&, UploadHash&, const FileInfo&, DiskPool::Task done);
+    void releaseObject(const std::string& hash, const std::string& owner);
+    void notifyRecipient(const FileInfo&);
+    static bool isZeroCopy(const std::string& hash, File&, int64_t end);
+    void readFileData(const std::string& hash, File&, int64_t offset, int64_t length, std::string& data);
+    static void writeFileData(const std::string& fileuuid, const std::shared_ptr<File>&, const std::shared_ptr<UploadHash>&, std::shared_ptr<std::string> data, int64_t offset, const std::shared_ptr<DiskBacklog>&, DiskPool::Task done = DiskPool::Task());
+    void completeFileData(const std::string& uuid, int64_t transfer, const std::string& fileuuid, int64_t end, TcpSocket*, uint64_t id);
+    void completeUpload(const std::string& uuid, int64_t transfer, const std::string& fileuuid, const std::shared_ptr<File>&, int64_t crc, const std::shared_ptr<UploadHash>&, TcpSocket*, uint64_t id);
+    void finishUpload(const std::string& uuid, int64_t transfer, const std::string& fileuuid, TcpSocket*, uint64_t id);
+
+    bool acceptFileData(FileClientInfo*, const FileInfo&, int64_t offset);
+    void finishFileData(const std::string& uuid, int64_t transfer, FileClientInfo*, FileInfo&, bool accepted, int64_t end, TcpSocket*);
+    void ackFileData(FileClientInfo&, const FileInfo&, TcpSocket*);
+
+    int64_t sendFileData(const std::string& uuid, FileClientInfo& info, const FileInfo& fileInfo, int64_t maxSize, TcpSocket*);
+    void pushFileData(TcpSocket*);
+
     std::mutex mutex;
+    FileStore store;
+    ChunkCache chunkCache;
     std::map<std::string, UserInfo> globalUserInfo; // key: username
     std::map<std::string, FileInfo> globalFileInfo; // key: uuid
+    std::map<TcpSocket*, uint64_t> globalClients; // key: open client, value: its id
     std::map<TcpSocket*, std::string> globalUserClientInfo; // key: client, value: username
-    std::map<TcpSocket*, FileClientInfo> globalFileClientInfo; // key: client, value: fileuuid, isUpload
+    std::map<TcpSocket*, ClientTransferInfo> globalFileClientInfo; // key: client, value: its transfers
+    std::map<std::string, std::multiset<TcpSocket*>> globalFileFollowers; // key: fileuuid, value: clients following its upload
 };
 
-Controller::Controller() {
+Controller::Controller() : store(std::vector<std::string>(std::begin(STOREROOTS), std::end(STOREROOTS))), chunkCache(CHUNKCACHEBYTES) {
+    store.open();
     std::ifstream in("user.db", std::ios::binary);
-    if (in)
+    if (in) {
         deserialize(in);
+        scanStore();
+    }
 }
 
 Controller::~Controller() {
@@ -119,21 +251,38 @@ std::string Controller::createUUID() {
     return std::string(buffer);
 }
 
-template<unsigned long SIZE>
-bool Controller::havaEntireRequest(const ReadRingBuffer<SIZE> &buffer) {
+template<typename Buffer>
+bool Controller::havaEntireRequest(const Buffer &buffer) {
+    if (buffer.getOccupancy() < sizeof(uint32_t))
+        return false;
     uint32_t len = buffer.lookAheadUInt32LE();
     return buffer.getOccupancy() < len + sizeof(uint32_t) ? false : true;
 }
 
-template<unsigned long SIZE>
-bool Controller::handleEntireRequest(ReadRingBuffer<SIZE> &buffer, TcpSocket *client) {
+template<typename Buffer>
+bool Controller::haveEntireHeader(const Buffer &buffer) {
+    const unsigned long prefixLen = sizeof(uint32_t) + sizeof(uint16_t);
+    if (buffer.getOccupancy() < prefixLen)
+        return false;
+    std::string scratch;
+    BufferView prefix = buffer.getView(0, prefixLen, scratch);
+    uint16_t headerLen;
+    memcpy(&headerLen, prefix.data + sizeof(uint32_t), sizeof(uint16_t));
+    return buffer.getOccupancy() >= prefixLen + headerLen;
+}
+
+template<typename Buffer>
+bool Controller::handleEntireRequest(Buffer &buffer, TcpSocket *client) {
     std::unique_lock<std::mutex> lock(mutex);
     uint32_t len = buffer.getUInt32LE();
     uint16_t headerLen = buffer.getUInt16LE();
-    std::string header = buffer.getString(headerLen);
-    JsonReader reader(header);
-    std::string body = buffer.getString(len - sizeof(uint16_t) - headerLen);
+    unsigned long bodyLen = len - sizeof(uint16_t) - headerLen;
+    std::string headerScratch;
+    std::string bodyScratch;
+    JsonReader reader(buffer.getView(0, headerLen, headerScratch));
+    BufferView body = buffer.getView(headerLen, bodyLen, bodyScratch);
     bool ret = false;
+    int64_t transfer = reader.hasMember("transfer") ? reader.getInt64("transfer") : 0;
     switch (reader.getInt64("action")) {
         case REGISTEROP: {
             std::string uuid = reader.getString("uuid");
@@ -181,42 +330,535 @@ bool Controller::handleEntireRequest(ReadRingBuffer<SIZE> &buffer, TcpSocket *cl
             std::string uuid = reader.getString("uuid");
             std::string fileuuid = reader.getString("fileuuid");
             int64_t size = reader.getInt64("size");
-            ret = handleSendFileDataStartRequest(uuid, fileuuid, size, client);
+            int64_t offset = reader.hasMember("offset") ? reader.getInt64("offset") : 0;
+            int64_t ackInterval = reader.hasMember("ackinterval") ? reader.getInt64("ackinterval") : 0;
+            std::string hash = reader.hasMember("hash") ? reader.getString("hash") : std::string();
+            ret = handleSendFileDataStartRequest(uuid, transfer, fileuuid, size, offset, ackInterval, hash, client);
             break;
         }
         case SENDFILEDATAOP: {
             std::string uuid = reader.getString("uuid");
             std::string fileuuid = reader.getString("fileuuid");
+            int64_t offset = reader.hasMember("offset") ? reader.getInt64("offset") : -1;
             int64_t size = reader.getInt64("size");
-            ret = handleSendFileDataRequest(uuid, fileuuid, size, body, client);
+            ret = handleSendFileDataRequest(uuid, transfer, fileuuid, offset, size, body, client);
             break;
         }
         case SENDFILEDATAENDOP: {
             std::string uuid = reader.getString("uuid");
-            ret = handleSendFileDataEndRequest(uuid, client);
+            int64_t crc = reader.hasMember("crc") ? reader.getInt64("crc") : -1;
+            ret = handleSendFileDataEndRequest(uuid, transfer, crc, client);
             break;
         }
         case RECEIVEFILEDATASTARTOP: {
             std::string uuid = reader.getString("uuid");
             std::string fileuuid = reader.getString("fileuuid");
-            ret = handleReceiveFileDataStartRequest(uuid, fileuuid, client);
+            int64_t offset = reader.hasMember("offset") ? reader.getInt64("offset") : 0;
+            int64_t length = reader.hasMember("length") ? reader.getInt64("length") : -1;
+            int64_t window = reader.hasMember("window") ? reader.getInt64("window") : 0;
+            bool follow = reader.hasMember("follow") && reader.getInt64("follow") != 0;
+            ret = handleReceiveFileDataStartRequest(uuid, transfer, fileuuid, offset, length, window, follow, client);
             break;
         }
         case RECEIVEFILEDATAOP: {
             std::string uuid = reader.getString("uuid");
-            ret = handleReceiveFileDataRequest(uuid, client);
+            ret = handleReceiveFileDataRequest(uuid, transfer, client);
             break;
         }
         case RECEIVEFILEDATAENDOP: {
             std::string uuid = reader.getString("uuid");
-            ret = handleReceiveFileDataEndRequest(uuid, client);
+            ret = handleReceiveFileDataEndRequest(uuid, transfer, client);
+            break;
+        }
+        case RECEIVEFILEDATACREDITOP: {
+            std::string uuid = reader.getString("uuid");
+            int64_t credit = reader.getInt64("credit");
+            ret = handleReceiveFileDataCreditRequest(uuid, transfer, credit, client);
+            break;
+        }
+        case FILEOFFSETOP: {
+            std::string uuid = reader.getString("uuid");
+            std::string fileuuid = reader.getString("fileuuid");
+            ret = handleFileOffsetRequest(uuid, fileuuid, client);
+            break;
+        }
+        case RECEIVEFILERANGEOP: {
+            std::string uuid = reader.getString("uuid");
+            std::string fileuuid = reader.getString("fileuuid");
+            int64_t offset = reader.getInt64("offset");
+            int64_t length = reader.getInt64("length");
+            ret = handleReceiveFileRangeRequest(uuid, fileuuid, offset, length, client);
+            break;
         }
         default:
             break;
     }
+    buffer.skip(headerLen + bodyLen);
     return ret;
 }
 
+template<typename Buffer>
+bool Controller::beginStreamingRequest(Buffer &buffer, StreamingRequest &request, TcpSocket *client) {
+    const unsigned long prefixLen = sizeof(uint32_t) + sizeof(uint16_t);
+    if (!haveEntireHeader(buffer))
+        return false;
+    std::string prefixScratch;
+    BufferView prefix = buffer.getView(0, prefixLen, prefixScratch);
+    uint32_t len;
+    uint16_t headerLen;
+    memcpy(&len, prefix.data, sizeof(uint32_t));
+    memcpy(&headerLen, prefix.data + sizeof(uint32_t), sizeof(uint16_t));
+    std::string headerScratch;
+    JsonReader reader(buffer.getView(prefixLen, headerLen, headerScratch));
+    if (reader.getInt64("action") != SENDFILEDATAOP)
+        return false;
+    std::unique_lock<std::mutex> lock(mutex);
+    request.action = SENDFILEDATAOP;
+    request.uuid = reader.getString("uuid");
+    request.transfer = reader.hasMember("transfer") ? reader.getInt64("transfer") : 0;
+    request.fileuuid = reader.getString("fileuuid");
+    int64_t offset = reader.hasMember("offset") ? reader.getInt64("offset") : -1;
+    int64_t size = reader.getInt64("size");
+    auto fileIter = globalFileInfo.find(request.fileuuid);
+#ifdef DEBUG
+    fprintf(stderr, "send file data stream  filename: %s, size: %d\n", fileIter->second.filename.c_str(), static_cast<int>(size));
+#endif
+    FileClientInfo *info = findTransfer(client, request.transfer, request.fileuuid);
+    request.remaining = len - sizeof(uint16_t) - headerLen;
+    request.accepted = acceptFileData(info, fileIter->second, offset);
+    if (request.accepted) {
+        request.offset = fileIter->second.fsize;
+        fileIter->second.fsize = fileIter->second.fsize + size;
+        request.file = getTransferFile(info, request.fileuuid, O_WRONLY | O_CREAT);
+        request.hash = info != nullptr ? info->hash : nullptr;
+    } else {
+        request.offset = 0;
+        request.file = std::make_shared<File>();
+        request.hash.reset();
+    }
+    request.backlog = client->getDiskBacklog();
+    // Spliced bytes never pass through user space to be hashed. A pipe that
+    // still holds bytes of an earlier chunk may be drained on another disk
+    // thread, so a new one is taken then.
+    request.splice = SPLICEUPLOAD && request.file->isOpen() && !request.hash;
+    if (request.splice && (!request.pipe || request.pipe.use_count() > 1 || !request.pipe->isOpen()))
+        request.pipe = std::make_shared<SplicePipe>();
+    request.splice = request.splice && request.pipe->isOpen();
+    buffer.skip(prefixLen + headerLen);
+    return true;
+}
+
+// The bytes are copied out of the receive buffer and written on the disk
+// pool, in order with the rest of the file's I/O.
+bool Controller::handleStreamingData(StreamingRequest &request, const BufferView &data) {
+    if (request.file->isOpen())
+        writeFileData(request.fileuuid, request.file, request.hash, std::make_shared<std::string>(data.data, data.size), request.offset, request.backlog);
+    request.offset = request.offset + data.size;
+    request.remaining = request.remaining - data.size;
+    return true;
+}
+
+// Moves body bytes from the socket into the request's pipe. A disk pool job
+// splices them into the file, after the file's other queued I/O such as the
+// truncate and preallocation of the start op.
+ssize_t Controller::handleStreamingSplice(StreamingRequest &request, TcpSocket *client) {
+    std::shared_ptr<SplicePipe> pipe = request.pipe;
+    if (!pipe->isOpen()) {
+        request.splice = false;
+        errno = EAGAIN;
+        return -1;
+    }
+    ssize_t len = client->spliceTo(*pipe, std::min(request.remaining, pipe->getFree()), request.splice);
+    if (len <= 0)
+        return len;
+    std::shared_ptr<File> file = request.file;
+    std::shared_ptr<DiskBacklog> backlog = request.backlog;
+    int64_t offset = request.offset;
+    backlog->add(len);
+    DiskPool::get().submit(request.fileuuid, [pipe, file, offset, len, backlog]() {
+        if (!pipe->drainTo(file->getFd(), offset, len))
+            fprintf(stderr, "Error: can't write spliced bytes to file fd: %d\n", file->getFd());
+        backlog->remove(len);
+    });
+    request.offset = request.offset + len;
+    request.remaining = request.remaining - len;
+    return len;
+}
+
+// An accepted chunk is answered once the disk pool has written it.
+bool Controller::endStreamingRequest(StreamingRequest &request, TcpSocket *client) {
+    request.file.reset();
+    if (request.accepted) {
+        std::string uuid = request.uuid;
+        int64_t transfer = request.transfer;
+        std::string fileuuid = request.fileuuid;
+        int64_t end = request.offset;
+        uint64_t id = client->getId();
+        DiskPool::get().submit(fileuuid, DiskPool::Task(), [this, uuid, transfer, fileuuid, end, client, id]() {
+            completeFileData(uuid, transfer, fileuuid, end, client, id);
+        });
+        return true;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    auto fileIter = globalFileInfo.find(request.fileuuid);
+    finishFileData(request.uuid, request.transfer, findTransfer(client, request.transfer, request.fileuuid), fileIter->second, false, 0, client);
+    return true;
+}
+
+// Gives back the part of the reservation that never arrived, so the upload
+// cursor only covers bytes that were written.
+void Controller::abortStreamingRequest(StreamingRequest &request) {
+    request.file.reset();
+    std::unique_lock<std::mutex> lock(mutex);
+    auto fileIter = globalFileInfo.find(request.fileuuid);
+    if (request.accepted && fileIter != globalFileInfo.end() && fileIter->second.fsize == request.offset + static_cast<int64_t>(request.remaining))
+        fileIter->second.fsize = request.offset;
+}
+
+void Controller::UploadHash::update(const void *data, unsigned long n, int64_t offset) {
+    if (offset != hashed) {
+        hashed = -1;
+        return;
+    }
+    if (DEDUPSTORE)
+        sha.update(data, n);
+    if (UPLOADCHECKSUM)
+        crc = Crc32c::extend(crc, data, n);
+    hashed = hashed + n;
+}
+
+void Controller::addTransferMember(JsonWritter &writter, int64_t transfer) {
+    if (transfer != 0)
+        writter.addMember("transfer", transfer);
+}
+
+// Whether a client captured by a disk pool job is still connected. The id
+// tells it apart from a later client at the same address. Callers hold the
+// lock, so a client found here stays open until they release it.
+bool Controller::isOpen(TcpSocket *client, uint64_t id) {
+    auto iter = globalClients.find(client);
+    return iter != globalClients.end() && iter->second == id;
+}
+
+Controller::FileClientInfo* Controller::findTransfer(TcpSocket *client, int64_t transfer) {
+    auto clientIter = globalFileClientInfo.find(client);
+    if (clientIter == globalFileClientInfo.end())
+        return nullptr;
+    auto transferIter = clientIter->second.transfers.find(transfer);
+    if (transferIter == clientIter->second.transfers.end())
+        return nullptr;
+    return &transferIter->second;
+}
+
+Controller::FileClientInfo* Controller::findTransfer(TcpSocket *client, int64_t transfer, const std::string &fileuuid) {
+    FileClientInfo *info = findTransfer(client, transfer);
+    return info != nullptr && info->fileuuid == fileuuid ? info : nullptr;
+}
+
+// Replaces whatever transfer the client had running under the same id.
+Controller::FileClientInfo& Controller::addTransfer(TcpSocket *client, FileClientInfo &&info) {
+    auto& transfers = globalFileClientInfo[client].transfers;
+    int64_t transfer = info.transfer;
+    auto transferIter = transfers.find(transfer);
+    if (transferIter != transfers.end()) {
+        unfollow(transferIter->second, client);
+        transfers.erase(transferIter);
+    }
+    return transfers.insert(std::make_pair(transfer, std::move(info))).first->second;
+}
+
+void Controller::removeTransfer(TcpSocket *client, int64_t transfer) {
+    auto clientIter = globalFileClientInfo.find(client);
+    if (clientIter == globalFileClientInfo.end())
+        return;
+    auto transferIter = clientIter->second.transfers.find(transfer);
+    if (transferIter == clientIter->second.transfers.end())
+        return;
+    unfollow(transferIter->second, client);
+    clientIter->second.transfers.erase(transferIter);
+    if (clientIter->second.transfers.empty())
+        globalFileClientInfo.erase(clientIter);
+}
+
+void Controller::unfollow(const FileClientInfo &info, TcpSocket *client) {
+    if (!info.follow)
+        return;
+    auto followIter = globalFileFollowers.find(info.fileuuid);
+    if (followIter == globalFileFollowers.end())
+        return;
+    auto clientIter = followIter->second.find(client);
+    if (clientIter != followIter->second.end())
+        followIter->second.erase(clientIter);
+    if (followIter->second.empty())
+        globalFileFollowers.erase(followIter);
+}
+
+// More of the file has been uploaded; let the downloads waiting on it go on.
+void Controller::notifyFollowers(const std::string &fileuuid) {
+    auto followIter = globalFileFollowers.find(fileuuid);
+    if (followIter == globalFileFollowers.end())
+        return;
+    for (auto client : std::set<TcpSocket*>(followIter->second.begin(), followIter->second.end()))
+        pushFileData(client);
+}
+
+// A following download may not pass the bytes uploaded so far.
+int64_t Controller::getDownloadLimit(const FileClientInfo &info, const FileInfo &fileInfo) {
+    if (!info.follow)
+        return info.end;
+    return std::min(info.end, fileInfo.received);
+}
+
+// The file opened at the transfer's start op, or a one-off descriptor when
+// the request names a file outside any transfer.
+std::shared_ptr<File> Controller::getTransferFile(FileClientInfo *info, const std::string &fileuuid, int flags) {
+    if (info != nullptr && info->fileuuid == fileuuid && info->file->isOpen())
+        return info->file;
+    auto file = std::make_shared<File>();
+    std::string path = store.getUploadPath(fileuuid);
+    if (flags & O_CREAT)
+        store.createParent(path);
+    file->open(path, flags);
+    return file;
+}
+
+// Uploads are written under the file's uuid and read by content hash once
+// they are in the store.
+std::string Controller::getFilePath(const std::string &fileuuid, const FileInfo &fileInfo) {
+    return fileInfo.hash.empty() ? store.getUploadPath(fileuuid) : store.getPath(fileInfo.hash);
+}
+
+// Checks the database against the files on disk. Files that went missing
+// have to be uploaded again; uploads that older versions wrote to the
+// working directory are moved into the store. Files of the store that no
+// entry refers to, left by a crash before the last snapshot, are deleted.
+void Controller::scanStore() {
+    std::map<std::string, std::string> files;
+    store.scan(files);
+    fprintf(stderr, "Scan file store: %d files.\n", static_cast<int>(files.size()));
+    std::set<std::string> used;
+    for (auto &file : globalFileInfo) {
+        FileInfo &info = file.second;
+        std::string path = getFilePath(file.first, info);
+        std::string name = path.substr(path.rfind('/') + 1);
+        if (files.find(name) != files.end()) {
+            used.insert(name);
+            continue;
+        }
+        if (info.hash.empty() && info.received == 0)
+            continue;
+        if (info.hash.empty() && isLegacyName(file.first) && store.move(file.first, path)) {
+            used.insert(name);
+            continue;
+        }
+        fprintf(stderr, "Error: missing file: %s\n", file.first.c_str());
+        if (!info.hash.empty()) {
+            if (store.release(info.hash, info.subject))
+                store.remove(info.hash);
+            info.hash.clear();
+        }
+        info.received = 0;
+        info.crc = -1;
+    }
+    int removed = 0;
+    for (auto &file : files) {
+        if (used.find(file.first) != used.end() || !FileStore::isStoreName(file.first))
+            continue;
+        if (::unlink(file.second.c_str()) == 0)
+            ++removed;
+    }
+    if (removed > 0)
+        fprintf(stderr, "Remove %d unreferenced files from the store.\n", removed);
+}
+
+// Older versions named uploads after the uuid in the working directory. The
+// uuid comes from the client, so only a plain file name is looked up there.
+bool Controller::isLegacyName(const std::string &fileuuid) {
+    return !fileuuid.empty() && fileuuid != "." && fileuuid != ".." && fileuuid.find('/') == std::string::npos;
+}
+
+// The hash of a finished upload of size bytes, reading the file again if not
+// all of them went through the running hash. Runs on the disk pool.
+std::shared_ptr<Controller::UploadHash> Controller::finishUploadHash(const std::string &path, std::shared_ptr<UploadHash> hash, int64_t size) {
+    if (hash && hash->hashed == size)
+        return hash;
+    hash = std::make_shared<UploadHash>();
+    File file;
+    if (!file.open(path, O_RDONLY))
+        return nullptr;
+    char tmp[FILEBLOCKSIZE];
+    while (hash->hashed < size) {
+        ssize_t n = file.pread(tmp, std::min<int64_t>(FILEBLOCKSIZE, size - hash->hashed), hash->hashed);
+        if (n <= 0)
+            return nullptr;
+        hash->update(tmp, n, hash->hashed);
+    }
+    return hash;
+}
+
+// Moves a finished upload into the store.
+// Puts a finished upload into the store and runs done with the lock held.
+// The link or copy runs on the disk pool, keyed by the content hash so that
+// it is ordered with every other commit and deletion of the object; the
+// reference taken up front keeps the object from being deleted meanwhile.
+// The upload's own name is removed under the lock, once the file is only
+// read from the store, and the open upload file keeps that from freeing its
+// blocks until the job is gone.
+void Controller::storeFile(const std::string &fileuuid, const std::shared_ptr<File> &file, UploadHash &hash, const FileInfo &fileInfo, DiskPool::Task done) {
+    std::string digest = hash.sha.finish();
+    std::string path = store.getUploadPath(fileuuid);
+    std::string owner = fileInfo.subject;
+    store.addRef(digest, fileInfo.fsize, owner);
+    auto stored = std::make_shared<bool>(false);
+    DiskPool::get().submit(digest, [this, path, digest, stored]() {
+        *stored = store.commit(path, digest);
+    }, [this, file, fileuuid, path, digest, owner, stored, done]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto fileIter = globalFileInfo.find(fileuuid);
+        if (*stored) {
+            store.setStored(digest);
+            fileIter->second.hash = digest;
+            ::unlink(path.c_str());
+        } else {
+            fprintf(stderr, "Error: can't store file: %s\n", path.c_str());
+            releaseObject(digest, owner);
+        }
+        done();
+    });
+}
+
+// Drops a reference to a stored object. The last one deletes the object's
+// file on the disk pool, in order with commits of the same content.
+void Controller::releaseObject(const std::string &hash, const std::string &owner) {
+    if (!store.release(hash, owner))
+        return;
+    DiskPool::get().submit(hash, [this, hash]() {
+        store.remove(hash);
+    });
+}
+
+// Whether a download body up to end can go out with sendfile(). Stored files
+// are copied through the chunk cache instead while it is enabled, since
+// sendfile() would never consult it.
+bool Controller::isZeroCopy(const std::string &hash, File &file, int64_t end) {
+    return ZEROCOPYDOWNLOAD && (CHUNKCACHEBYTES == 0 || hash.empty()) && file.isOpen() && file.getSize() >= end;
+}
+
+// Copies a part of the file into data. Stored files never change, so their
+// blocks are read through the chunk cache.
+void Controller::readFileData(const std::string &hash, File &file, int64_t offset, int64_t length, std::string &data) {
+    data.assign(length, '\0');
+    if (!file.isOpen())
+        return;
+    if (CHUNKCACHEBYTES == 0 || hash.empty()) {
+        file.pread(&data[0], length, offset);
+        return;
+    }
+    int64_t pos = offset;
+    while (pos < offset + length) {
+        int64_t block = pos - pos % FILEBLOCKSIZE;
+        std::shared_ptr<const std::string> chunk = chunkCache.get(hash, block);
+        if (!chunk) {
+            std::string tmp(FILEBLOCKSIZE, '\0');
+            ssize_t n = file.pread(&tmp[0], FILEBLOCKSIZE, block);
+            if (n <= 0)
+                return;
+            if (n < FILEBLOCKSIZE) {
+                tmp.resize(n);
+                tmp.shrink_to_fit();
+            }
+            chunk = std::make_shared<const std::string>(std::move(tmp));
+            chunkCache.put(hash, block, chunk);
+        }
+        int64_t n = std::min<int64_t>(chunk->size() - (pos - block), offset + length - pos);
+        if (n <= 0)
+            return;
+        memcpy(&data[pos - offset], chunk->data() + (pos - block), n);
+        pos = pos + n;
+    }
+}
+
+// Writes the chunk and feeds the running hash on the disk pool, then runs
+// done there. The chunk counts against the sender's backlog until written.
+void Controller::writeFileData(const std::string &fileuuid, const std::shared_ptr<File> &file, const std::shared_ptr<UploadHash> &hash, std::shared_ptr<std::string> data, int64_t offset, const std::shared_ptr<DiskBacklog> &backlog, DiskPool::Task done) {
+    backlog->add(data->size());
+    DiskPool::get().submit(fileuuid, [file, hash, data, offset, backlog]() {
+        if (file->isOpen() && file->pwrite(data->data(), data->size(), offset) == static_cast<ssize_t>(data->size()) && hash)
+            hash->update(data->data(), data->size(), offset);
+        backlog->remove(data->size());
+    }, std::move(done));
+}
+
+// Called on the disk pool once every byte of the upload before end is in
+// the file. A closed client's upload was already cut back, so nothing is left
+// to account for.
+void Controller::completeFileData(const std::string &uuid, int64_t transfer, const std::string &fileuuid, int64_t end, TcpSocket *client, uint64_t id) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!isOpen(client, id))
+        return;
+    auto fileIter = globalFileInfo.find(fileuuid);
+    finishFileData(uuid, transfer, findTransfer(client, transfer, fileuuid), fileIter->second, true, end, client);
+    notifyFollowers(fileuuid);
+}
+
+void Controller::notifyRecipient(const FileInfo &fileInfo) {
+    auto object = globalUserInfo.find(fileInfo.object);
+    if (object->second.isLogin()) {
+        JsonWritter objectWritter;
+        objectWritter.addMember("action", SENDFILEOP);
+        objectWritter.addMember("uuid", "message");
+        objectWritter.addMember("status", SUCCESS);
+        objectWritter.addClass("file", fileInfo);
+        object->second.client->write(objectWritter.getString());
+    } else {
+        object->second.files.push_back(fileInfo);
+    }
+}
+
+// Pipelined chunks must continue exactly where the upload is; others go to
+// the cursor as before.
+bool Controller::acceptFileData(FileClientInfo *info, const FileInfo &fileInfo, int64_t offset) {
+    if (info == nullptr || !info->pipelined)
+        return true;
+    return offset == fileInfo.fsize;
+}
+
+// A written chunk only counts while the upload that reserved it is still
+// running; an abandoned one is accounted for when its file is cut back.
+void Controller::finishFileData(const std::string &uuid, int64_t transfer, FileClientInfo *info, FileInfo &fileInfo, bool accepted, int64_t end, TcpSocket *client) {
+    if (accepted && fileInfo.fsize >= end)
+        fileInfo.received = std::max(fileInfo.received, end);
+    if (info != nullptr && info->pipelined && accepted) {
+        if (fileInfo.received - info->acked >= info->ackInterval)
+            ackFileData(*info, fileInfo, client);
+        return;
+    }
+    JsonWritter subjectWritter;
+    subjectWritter.addMember("action", SENDFILEDATAOP);
+    subjectWritter.addMember("uuid", uuid);
+    addTransferMember(subjectWritter, transfer);
+    if (!accepted) {
+        subjectWritter.addMember("offset", fileInfo.fsize);
+        subjectWritter.addMember("status", OFFSETMISMATCH);
+    } else {
+        subjectWritter.addMember("status", SUCCESS);
+    }
+    client->write(subjectWritter.getString());
+}
+
+// Cumulative ack under the start request's uuid: every byte before offset
+// is written to the file.
+void Controller::ackFileData(FileClientInfo &info, const FileInfo &fileInfo, TcpSocket *client) {
+    info.acked = fileInfo.received;
+    JsonWritter subjectWritter;
+    subjectWritter.addMember("action", SENDFILEDATAOP);
+    subjectWritter.addMember("uuid", info.uuid);
+    addTransferMember(subjectWritter, info.transfer);
+    subjectWritter.addMember("offset", info.acked);
+    subjectWritter.addMember("status", SUCCESS);
+    client->write(subjectWritter.getString());
+}
+
 bool Controller::handleRegisterRequest(const std::string &uuid, const std::string &username, const std::string &password, TcpSocket *client) {
 #ifdef DEBUG
     fprintf(stderr, "register  username: %s, password: %s\n", username.c_str(), password.c_str());
@@ -415,122 +1057,516 @@ bool Controller::handleSendFileRequest(const std::string &uuid, FileInfo &file,
     return true;
 }
 
-bool Controller::handleSendFileDataStartRequest(const std::string &uuid, const std::string &fileuuid, const int64_t size, TcpSocket *client) {
+bool Controller::handleSendFileDataStartRequest(const std::string &uuid, int64_t transfer, const std::string &fileuuid, const int64_t size, int64_t offset, int64_t ackInterval, const std::string &hash, TcpSocket *client) {
     auto fileIter = globalFileInfo.find(fileuuid);
 #ifdef DEBUG
-    fprintf(stderr, "send file data start  filename: %s, size: %d\n", fileIter->second.filename.c_str(), static_cast<int>(size));
+    fprintf(stderr, "send file data start  filename: %s, size: %d, offset: %d\n", fileIter->second.filename.c_str(), static_cast<int>(size), static_cast<int>(offset));
 #endif
-    globalFileClientInfo.insert(std::make_pair(client, FileClientInfo(fileuuid, true)));
-    fileIter->second.fsize = 0;
-    std::ofstream fout(fileuuid, std::ios::out | std::ios::binary);
-    fout.close();
     JsonWritter subjectWritter;
     subjectWritter.addMember("action", SENDFILEDATASTARTOP);
     subjectWritter.addMember("uuid", uuid);
+    addTransferMember(subjectWritter, transfer);
+    // A resumed upload can only continue from bytes the server already has.
+    if (offset < 0 || offset > fileIter->second.received) {
+        subjectWritter.addMember("offset", fileIter->second.received);
+        subjectWritter.addMember("status", OFFSETMISMATCH);
+        client->write(subjectWritter.getString());
+        return false;
+    }
+    // A stored file may be shared, so it is only ever replaced as a whole.
+    if (!fileIter->second.hash.empty()) {
+        if (offset > 0) {
+            subjectWritter.addMember("offset", fileIter->second.received);
+            subjectWritter.addMember("status", FILEEXIST);
+            client->write(subjectWritter.getString());
+            return false;
+        }
+        releaseObject(fileIter->second.hash, fileIter->second.subject);
+        fileIter->second.hash.clear();
+    }
+    fileIter->second.crc = -1;
+    // Content the store has already needs no upload at all. Naming a hash
+    // proves nothing about having the bytes, so this only works for content
+    // the client's own user has stored before, and only when the declared
+    // sizes match the object; otherwise the hint is ignored and the bytes are
+    // uploaded and hashed as usual.
+    auto userIter = globalUserClientInfo.find(client);
+    int64_t declared = size > 0 ? size : fileIter->second.size;
+    if (DEDUPSTORE && !hash.empty() && store.contains(hash) && userIter != globalUserClientInfo.end() && store.isOwner(hash, userIter->second) &&
+        store.getSize(hash) == declared && declared == fileIter->second.size) {
+#ifdef DEBUG
+        fprintf(stderr, "send file data exist  filename: %s, hash: %s\n", fileIter->second.filename.c_str(), hash.c_str());
+#endif
+        store.addRef(hash, store.getSize(hash), fileIter->second.subject);
+        ::unlink(store.getUploadPath(fileuuid).c_str());
+        fileIter->second.hash = hash;
+        fileIter->second.received = store.getSize(hash);
+        fileIter->second.fsize = -1;
+        subjectWritter.addMember("offset", fileIter->second.received);
+        subjectWritter.addMember("status", FILEEXIST);
+        client->write(subjectWritter.getString());
+        notifyFollowers(fileIter->first);
+        notifyRecipient(fileIter->second);
+        return true;
+    }
+    auto file = std::make_shared<File>();
+    std::string path = store.getUploadPath(fileuuid);
+    store.createParent(path);
+    if (!file->open(path, O_WRONLY | O_CREAT)) {
+        fprintf(stderr, "Error: can't open file: %s\n", fileuuid.c_str());
+    } else {
+        int64_t allocate = PREALLOCATEUPLOAD ? (size > 0 ? size : fileIter->second.size) : 0;
+        DiskPool::get().submit(fileuuid, [file, offset, allocate]() {
+            if (offset == 0)
+                file->truncate(0);
+            if (allocate > 0)
+                file->allocate(allocate);
+        });
+    }
+    FileClientInfo &info = addTransfer(client, FileClientInfo(fileuuid, transfer, true, file));
+    if (ackInterval > 0) {
+        info.pipelined = true;
+        info.ackInterval = ackInterval;
+        info.acked = offset;
+        info.uuid = uuid;
+    }
+    if (DEDUPSTORE || UPLOADCHECKSUM)
+        info.hash = std::make_shared<UploadHash>();
+    fileIter->second.fsize = offset;
+    fileIter->second.received = offset;
+    subjectWritter.addMember("offset", offset);
     subjectWritter.addMember("status", SUCCESS);
     client->write(subjectWritter.getString());
+    // An online recipient can start following the upload right away.
+    auto object = globalUserInfo.find(fileIter->second.object);
+    if (NOTIFYUPLOADSTART && object != globalUserInfo.end() && object->second.isLogin()) {
+        JsonWritter objectWritter;
+        objectWritter.addMember("action", FILEUPLOADINGOP);
+        objectWritter.addMember("uuid", "message");
+        objectWritter.addMember("status", SUCCESS);
+        objectWritter.addClass("file", fileIter->second);
+        objectWritter.addMember("offset", offset);
+        object->second.client->write(objectWritter.getString());
+    }
     return true;
 }
 
-bool Controller::handleSendFileDataRequest(const std::string &uuid, const std::string &fileuuid, const int64_t size, const std::string &filedata, TcpSocket *client) {
+bool Controller::handleSendFileDataRequest(const std::string &uuid, int64_t transfer, const std::string &fileuuid, int64_t offset, const int64_t size, const BufferView &filedata, TcpSocket *client) {
     auto fileIter = globalFileInfo.find(fileuuid);
 #ifdef DEBUG
     fprintf(stderr, "send file data  filename: %s, size: %d\n", fileIter->second.filename.c_str(), static_cast<int>(size));
 #endif
+    FileClientInfo *info = findTransfer(client, transfer, fileuuid);
+    if (!acceptFileData(info, fileIter->second, offset)) {
+        finishFileData(uuid, transfer, info, fileIter->second, false, 0, client);
+        return true;
+    }
+    offset = fileIter->second.fsize;
     fileIter->second.fsize = fileIter->second.fsize + size;
-    std::ofstream fout(fileuuid, std::ios::out | std::ios::binary | std::ios::app);
-    fout.write(filedata.c_str(), size);
-    fout.close();
-    JsonWritter subjectWritter;
-    subjectWritter.addMember("action", SENDFILEDATAOP);
-    subjectWritter.addMember("uuid", uuid);
-    subjectWritter.addMember("status", SUCCESS);
-    client->write(subjectWritter.getString());
+    auto file = getTransferFile(info, fileuuid, O_WRONLY | O_CREAT);
+    if (!file->isOpen()) {
+        finishFileData(uuid, transfer, info, fileIter->second, true, offset + size, client);
+        notifyFollowers(fileuuid);
+        return true;
+    }
+    auto data = std::make_shared<std::string>(filedata.data, std::min<int64_t>(size, filedata.size));
+    int64_t end = offset + size;
+    uint64_t id = client->getId();
+    writeFileData(fileuuid, file, info != nullptr ? info->hash : nullptr, data, offset, client->getDiskBacklog(), [this, uuid, transfer, fileuuid, end, client, id]() {
+        completeFileData(uuid, transfer, fileuuid, end, client, id);
+    });
     return true;
 }
 
-bool Controller::handleSendFileDataEndRequest(const std::string &uuid, TcpSocket *client) {
-    auto fileClientIter = globalFileClientInfo.find(client);
-    auto fileIter = globalFileInfo.find(fileClientIter->second.fileuuid);
+// Truncating and hashing the finished file run on the disk pool, after the
+// writes still queued for it; the reply is sent from there.
+bool Controller::handleSendFileDataEndRequest(const std::string &uuid, int64_t transfer, int64_t crc, TcpSocket *client) {
+    FileClientInfo *info = findTransfer(client, transfer);
+    if (info == nullptr || !info->isUpload || info->ending)
+        return false;
+    auto fileIter = globalFileInfo.find(info->fileuuid);
 #ifdef DEBUG
     fprintf(stderr, "send file data end  filename: %s\n", fileIter->second.filename.c_str());
 #endif
-    globalFileClientInfo.erase(fileClientIter);
-    fileIter->second.fsize = -1;
-    auto object = globalUserInfo.find(fileIter->second.object);
-    if (object->second.isLogin()) {
-        JsonWritter objectWritter;
-        objectWritter.addMember("action", SENDFILEOP);
-        objectWritter.addMember("uuid", "message");
-        objectWritter.addMember("status", SUCCESS);
-        objectWritter.addClass("file", fileIter->second);
-        object->second.client->write(objectWritter.getString());
-    } else {
-        object->second.files.push_back(fileIter->second);
-    }
-    client->shutdown();
+    info->ending = true;
+    std::string fileuuid = info->fileuuid;
+    std::shared_ptr<File> file = info->file;
+    std::shared_ptr<UploadHash> hash = info->hash;
+    std::string path = store.getUploadPath(fileuuid);
+    int64_t fsize = fileIter->second.fsize;
+    int64_t size = fileIter->second.size;
+    auto result = std::make_shared<std::shared_ptr<UploadHash>>();
+    uint64_t id = client->getId();
+    DiskPool::get().submit(fileuuid, [file, hash, path, fsize, size, result]() {
+        // Drops the preallocated tail of an upload that ended short.
+        if (fsize >= 0 && fsize < size)
+            file->truncate(fsize);
+        if (DEDUPSTORE || UPLOADCHECKSUM)
+            *result = finishUploadHash(path, hash, fsize);
+    }, [this, uuid, transfer, fileuuid, file, crc, result, client, id]() {
+        completeUpload(uuid, transfer, fileuuid, file, crc, *result, client, id);
+    });
     return true;
 }
 
-bool Controller::handleReceiveFileDataStartRequest(const std::string &uuid, const std::string &fileuuid, TcpSocket *client) {
+// The upload is finished even if its client closed in the meantime; only the
+// replies are left out then.
+void Controller::completeUpload(const std::string &uuid, int64_t transfer, const std::string &fileuuid, const std::shared_ptr<File> &file, int64_t crc, const std::shared_ptr<UploadHash> &hash, TcpSocket *client, uint64_t id) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto fileIter = globalFileInfo.find(fileuuid);
+    bool open = isOpen(client, id);
+    FileClientInfo *info = open ? findTransfer(client, transfer, fileuuid) : nullptr;
+    fileIter->second.received = fileIter->second.fsize;
+    if (info != nullptr && info->pipelined && info->acked < fileIter->second.received)
+        ackFileData(*info, fileIter->second, client);
+    if (UPLOADCHECKSUM && hash)
+        fileIter->second.crc = hash->crc;
+    // A checksum that differs from the client's drops the upload; it has to
+    // be sent again from the start.
+    if (UPLOADCHECKSUM && hash && crc >= 0 && crc != fileIter->second.crc) {
+#ifdef DEBUG
+        fprintf(stderr, "send file data checksum mismatch  filename: %s\n", fileIter->second.filename.c_str());
+#endif
+        DiskPool::get().submit(fileuuid, [file]() { file->truncate(0); });
+        if (info != nullptr)
+            removeTransfer(client, transfer);
+        fileIter->second.received = 0;
+        fileIter->second.fsize = -1;
+        if (open) {
+            JsonWritter subjectWritter;
+            subjectWritter.addMember("action", SENDFILEDATAENDOP);
+            subjectWritter.addMember("uuid", uuid);
+            addTransferMember(subjectWritter, transfer);
+            subjectWritter.addMember("crc", fileIter->second.crc);
+            subjectWritter.addMember("status", CHECKSUMMISMATCH);
+            client->write(subjectWritter.getString());
+            if (transfer == 0)
+                client->shutdownAfterFlush();
+        }
+        fileIter->second.crc = -1;
+        return;
+    }
+    if (DEDUPSTORE && hash) {
+        storeFile(fileuuid, file, *hash, fileIter->second, [this, uuid, transfer, fileuuid, client, id]() {
+            finishUpload(uuid, transfer, fileuuid, client, id);
+        });
+        return;
+    }
+    finishUpload(uuid, transfer, fileuuid, client, id);
+}
+
+// Ends the upload once its file is where downloads will read it. Called
+// with the lock held.
+void Controller::finishUpload(const std::string &uuid, int64_t transfer, const std::string &fileuuid, TcpSocket *client, uint64_t id) {
+    auto fileIter = globalFileInfo.find(fileuuid);
+    bool open = isOpen(client, id);
+    if (open && findTransfer(client, transfer, fileuuid) != nullptr)
+        removeTransfer(client, transfer);
+    fileIter->second.fsize = -1;
+    notifyFollowers(fileuuid);
+    notifyRecipient(fileIter->second);
+    if (open)
+        endTransfer(SENDFILEDATAENDOP, uuid, transfer, client);
+}
+
+bool Controller::handleReceiveFileDataStartRequest(const std::string &uuid, int64_t transfer, const std::string &fileuuid, int64_t offset, int64_t length, int64_t window, bool follow, TcpSocket *client) {
     auto fileIter = globalFileInfo.find(fileuuid);
 #ifdef DEBUG
-    fprintf(stderr, "receive file data start  filename: %s\n", fileIter->second.filename.c_str());
+    fprintf(stderr, "receive file data start  filename: %s, window: %d\n", fileIter->second.filename.c_str(), static_cast<int>(window));
 #endif
-    globalFileClientInfo.insert(std::make_pair(client, FileClientInfo(fileuuid, false)));
-    fileIter->second.fsize = 0;
+    auto file = std::make_shared<File>();
+    if (!file->open(getFilePath(fileuuid, fileIter->second), O_RDONLY))
+        fprintf(stderr, "Error: can't open file: %s\n", fileuuid.c_str());
+    FileClientInfo &info = addTransfer(client, FileClientInfo(fileuuid, transfer, false, file));
+    info.offset = std::max<int64_t>(0, std::min(offset, fileIter->second.size));
+    info.end = length < 0 ? fileIter->second.size : std::min(info.offset + length, fileIter->second.size);
+    if (follow) {
+        info.follow = true;
+        globalFileFollowers[fileuuid].insert(client);
+    }
     JsonWritter subjectWritter;
     subjectWritter.addMember("action", RECEIVEFILEDATASTARTOP);
     subjectWritter.addMember("uuid", uuid);
+    addTransferMember(subjectWritter, transfer);
+    subjectWritter.addMember("offset", info.offset);
+    subjectWritter.addMember("size", info.end - info.offset);
+    // The checksum covers the whole uploaded file only.
+    if (fileIter->second.crc >= 0 && info.offset == 0 && info.end == fileIter->second.received)
+        subjectWritter.addMember("crc", fileIter->second.crc);
     subjectWritter.addMember("status", SUCCESS);
     client->write(subjectWritter.getString());
+    if (window > 0) {
+        info.windowed = true;
+        info.credit = window;
+        info.uuid = uuid;
+        pushFileData(client);
+    }
     return true;
 }
 
-bool Controller::handleReceiveFileDataRequest(const std::string &uuid, TcpSocket *client) {
-    auto fileClientIter = globalFileClientInfo.find(client);
-    auto fileIter = globalFileInfo.find(fileClientIter->second.fileuuid);
-    char tmp[FILEBLOCKSIZE] = {};
-    fprintf(stderr, "fsize  %d\n", fileIter->second.fsize);
-    std::ifstream fin(fileIter->second.uuid, fin.binary | fin.in);
-    fin.seekg(fileIter->second.fsize);
-    fin.read(tmp, FILEBLOCKSIZE);
-    fin.close();
-    int64_t delta = fileIter->second.fsize + FILEBLOCKSIZE > fileIter->second.size ? fileIter->second.size - fileIter->second.fsize : FILEBLOCKSIZE;
-    std::string data(tmp, delta);
-    fileIter->second.fsize = fileIter->second.fsize + delta;
-    fprintf(stderr, "fsize  %d\n", fileIter->second.fsize);
+bool Controller::handleReceiveFileDataRequest(const std::string &uuid, int64_t transfer, TcpSocket *client) {
+    FileClientInfo *info = findTransfer(client, transfer);
+    if (info == nullptr || info->isUpload)
+        return false;
+    auto fileIter = globalFileInfo.find(info->fileuuid);
+    sendFileData(uuid, *info, fileIter->second, FILEBLOCKSIZE, client);
+    return true;
+}
+
+bool Controller::handleReceiveFileDataEndRequest(const std::string &uuid, int64_t transfer, TcpSocket *client) {
+    FileClientInfo *info = findTransfer(client, transfer);
+    if (info == nullptr || info->isUpload)
+        return false;
+#ifdef DEBUG
+    fprintf(stderr, "receive file data end  fileuuid: %s\n", info->fileuuid.c_str());
+#endif
+    removeTransfer(client, transfer);
+    endTransfer(RECEIVEFILEDATAENDOP, uuid, transfer, client);
+    return true;
+}
+
+bool Controller::handleReceiveFileDataCreditRequest(const std::string &uuid, int64_t transfer, int64_t credit, TcpSocket *client) {
+    FileClientInfo *info = findTransfer(client, transfer);
+    if (info == nullptr || !info->windowed)
+        return false;
 #ifdef DEBUG
-    fprintf(stderr, "receive file data  filename: %s, size: %d\n", fileIter->second.filename.c_str(), static_cast<int>(data.size()));
+    fprintf(stderr, "receive file data credit  fileuuid: %s, credit: %d\n", info->fileuuid.c_str(), static_cast<int>(credit));
 #endif
+    if (credit > 0)
+        info->credit = info->credit + credit;
+    pushFileData(client);
+    return true;
+}
+
+// Where an interrupted upload of the file can resume.
+bool Controller::handleFileOffsetRequest(const std::string &uuid, const std::string &fileuuid, TcpSocket *client) {
+    auto fileIter = globalFileInfo.find(fileuuid);
     JsonWritter subjectWritter;
-    subjectWritter.addMember("action", RECEIVEFILEDATAOP);
+    subjectWritter.addMember("action", FILEOFFSETOP);
     subjectWritter.addMember("uuid", uuid);
-    subjectWritter.addMember("size", data.size());
+    subjectWritter.addMember("fileuuid", fileuuid);
+    if (fileIter == globalFileInfo.end()) {
+        subjectWritter.addMember("status", FILENOTEXIST);
+        client->write(subjectWritter.getString());
+        return false;
+    }
+#ifdef DEBUG
+    fprintf(stderr, "file offset  filename: %s, offset: %d\n", fileIter->second.filename.c_str(), static_cast<int>(fileIter->second.received));
+#endif
+    subjectWritter.addMember("offset", fileIter->second.received);
+    subjectWritter.addMember("size", fileIter->second.size);
     subjectWritter.addMember("status", SUCCESS);
-    client->write(subjectWritter.getString(), data);
+    client->write(subjectWritter.getString());
     return true;
 }
 
-bool Controller::handleReceiveFileDataEndRequest(const std::string &uuid, TcpSocket *client) {
-    auto fileClientIter = globalFileClientInfo.find(client);
-    auto fileIter = globalFileInfo.find(fileClientIter->second.fileuuid);
+// Answers with one frame holding the requested bytes. It keeps no cursor, so
+// any number of connections can fetch disjoint ranges of a file at once.
+bool Controller::handleReceiveFileRangeRequest(const std::string &uuid, const std::string &fileuuid, int64_t offset, int64_t length, TcpSocket *client) {
+    auto fileIter = globalFileInfo.find(fileuuid);
+    JsonWritter subjectWritter;
+    subjectWritter.addMember("action", RECEIVEFILERANGEOP);
+    subjectWritter.addMember("uuid", uuid);
+    subjectWritter.addMember("fileuuid", fileuuid);
+    if (fileIter == globalFileInfo.end()) {
+        subjectWritter.addMember("status", FILENOTEXIST);
+        client->write(subjectWritter.getString());
+        return false;
+    }
+    // Only bytes that have been uploaded can be read.
+    int64_t available = fileIter->second.received;
+    if (offset < 0 || length < 0 || offset > available) {
+        subjectWritter.addMember("offset", available);
+        subjectWritter.addMember("status", OFFSETMISMATCH);
+        client->write(subjectWritter.getString());
+        return false;
+    }
+    length = std::min(std::min(length, available - offset), FILERANGEMAXSIZE);
 #ifdef DEBUG
-    fprintf(stderr, "receive file data end  filename: %s\n", fileIter->second.filename.c_str());
+    fprintf(stderr, "receive file range  filename: %s, offset: %d, size: %d\n", fileIter->second.filename.c_str(), static_cast<int>(offset), static_cast<int>(length));
 #endif
-    globalFileClientInfo.erase(fileClientIter);
-    fileIter->second.fsize = -1;
-    client->shutdown();
+    subjectWritter.addMember("offset", offset);
+    subjectWritter.addMember("size", length);
+    subjectWritter.addMember("status", SUCCESS);
+    auto file = std::make_shared<File>();
+    file->open(getFilePath(fileuuid, fileIter->second), O_RDONLY);
+    std::string header = subjectWritter.getString();
+    std::string hash = fileIter->second.hash;
+    auto data = std::make_shared<std::string>();
+    auto zeroCopy = std::make_shared<bool>(false);
+    uint64_t id = client->getId();
+    DiskPool::get().submit(fileuuid, [this, file, hash, offset, length, data, zeroCopy]() {
+        *zeroCopy = isZeroCopy(hash, *file, offset + length);
+        if (!*zeroCopy)
+            readFileData(hash, *file, offset, length, *data);
+    }, [this, file, header, offset, length, data, zeroCopy, client, id]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!isOpen(client, id))
+            return;
+        if (*zeroCopy)
+            client->write(header, file, offset, length);
+        else
+            client->write(header, *data);
+    });
+    return true;
+}
+
+// Called by the connection once its outbound queue has drained, to keep
+// windowed downloads going.
+bool Controller::handleClientDrain(TcpSocket *client) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (globalFileClientInfo.find(client) == globalFileClientInfo.end())
+        return false;
+    pushFileData(client);
+    return true;
+}
+
+// A legacy transfer (id 0) ends its connection; a multiplexed one answers
+// the End op and leaves the connection open for the next transfer.
+void Controller::endTransfer(int action, const std::string &uuid, int64_t transfer, TcpSocket *client) {
+    if (transfer == 0) {
+        client->shutdownAfterFlush();
+        return;
+    }
+    JsonWritter subjectWritter;
+    subjectWritter.addMember("action", action);
+    subjectWritter.addMember("uuid", uuid);
+    addTransferMember(subjectWritter, transfer);
+    subjectWritter.addMember("status", SUCCESS);
+    client->write(subjectWritter.getString());
+}
+
+// Queues the next chunk of the download at the transfer's cursor, at most
+// maxSize bytes, and returns its size. The chunk is read on the disk pool and
+// dropped there if the transfer ended in the meantime.
+int64_t Controller::sendFileData(const std::string &uuid, FileClientInfo &info, const FileInfo &fileInfo, int64_t maxSize, TcpSocket *client) {
+    int64_t offset = info.offset;
+    int64_t limit = getDownloadLimit(info, fileInfo);
+    int64_t delta = std::max<int64_t>(0, offset + maxSize > limit ? limit - offset : maxSize);
+    info.offset = offset + delta;
+#ifdef DEBUG
+    fprintf(stderr, "receive file data  filename: %s, offset: %d, size: %d\n", fileInfo.filename.c_str(), static_cast<int>(offset), static_cast<int>(delta));
+#endif
+    JsonWritter subjectWritter;
+    subjectWritter.addMember("action", RECEIVEFILEDATAOP);
+    subjectWritter.addMember("uuid", uuid);
+    addTransferMember(subjectWritter, info.transfer);
+    subjectWritter.addMember("offset", offset);
+    subjectWritter.addMember("size", delta);
+    subjectWritter.addMember("status", SUCCESS);
+    std::shared_ptr<File> file = info.file;
+    if (!file->isOpen())
+        file->open(getFilePath(info.fileuuid, fileInfo), O_RDONLY);
+    globalFileClientInfo[client].pending += delta;
+    std::string header = subjectWritter.getString();
+    std::string hash = fileInfo.hash;
+    std::string fileuuid = info.fileuuid;
+    int64_t transfer = info.transfer;
+    auto data = std::make_shared<std::string>();
+    auto zeroCopy = std::make_shared<bool>(false);
+    uint64_t id = client->getId();
+    DiskPool::get().submit(fileuuid, [this, file, hash, offset, delta, data, zeroCopy]() {
+        *zeroCopy = isZeroCopy(hash, *file, offset + delta);
+        if (!*zeroCopy)
+            readFileData(hash, *file, offset, delta, *data);
+    }, [this, file, header, fileuuid, transfer, offset, delta, data, zeroCopy, client, id]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!isOpen(client, id))
+            return;
+        auto clientIter = globalFileClientInfo.find(client);
+        if (clientIter == globalFileClientInfo.end())
+            return;
+        clientIter->second.pending -= delta;
+        FileClientInfo *info = findTransfer(client, transfer, fileuuid);
+        if (info == nullptr || info->file != file)
+            return;
+        if (*zeroCopy)
+            client->write(header, file, offset, delta);
+        else
+            client->write(header, *data);
+        pushFileData(client);
+    });
+    return delta;
+}
+
+// Round-robins one chunk at a time over the client's windowed downloads that
+// have credit, stopping early once enough is queued or still being read; the
+// rest follows from handleClientDrain as the queue empties, which the
+// connection only calls after such a stop.
+void Controller::pushFileData(TcpSocket *client) {
+    auto clientIter = globalFileClientInfo.find(client);
+    if (clientIter == globalFileClientInfo.end())
+        return;
+    auto &transfers = clientIter->second.transfers;
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        auto iter = transfers.lower_bound(clientIter->second.nextPush);
+        for (size_t i = 0; i < transfers.size(); ++i, ++iter) {
+            if (client->isDropped())
+                return;
+            if (iter == transfers.end())
+                iter = transfers.begin();
+            FileClientInfo &info = iter->second;
+            auto fileIter = globalFileInfo.find(info.fileuuid);
+            if (!info.windowed || info.credit <= 0 || fileIter == globalFileInfo.end() || info.offset >= getDownloadLimit(info, fileIter->second))
+                continue;
+            if (client->getOutboundBytes() + clientIter->second.pending >= DOWNLOADQUEUEBYTES) {
+                client->setDrainWanted();
+                return;
+            }
+            int64_t delta = sendFileData(info.uuid, info, fileIter->second, std::min<int64_t>(info.credit, FILEBLOCKSIZE), client);
+            info.credit = info.credit - delta;
+            clientIter->second.nextPush = iter->first + 1;
+            progress = progress || delta > 0;
+        }
+    }
+}
+
+bool Controller::handleClientOpen(TcpSocket *client) {
+    std::unique_lock<std::mutex> lock(mutex);
+    globalClients[client] = client->getId();
     return true;
 }
 
 bool Controller::handleClientClose(TcpSocket *client) {
     std::unique_lock<std::mutex> lock(mutex);
+    globalClients.erase(client);
     auto userClientIter = globalUserClientInfo.find(client);
     if (userClientIter != globalUserClientInfo.end()) {
         globalUserInfo.find(userClientIter->second)->second.quit();
         globalUserClientInfo.erase(userClientIter);
     }
+    // Abandoned uploads keep only the bytes that arrived; the file is cut back
+    // after the writes still queued for it. An upload whose End op is on the
+    // disk pool finishes there. Erasing the transfers closes their files
+    // unless queued frames or jobs still use them.
+    auto clientIter = globalFileClientInfo.find(client);
+    if (clientIter == globalFileClientInfo.end())
+        return false;
+    for (auto &transfer : clientIter->second.transfers) {
+        FileClientInfo &info = transfer.second;
+        unfollow(info, client);
+        auto fileIter = globalFileInfo.find(info.fileuuid);
+        if (info.isUpload && !info.ending && fileIter != globalFileInfo.end() && fileIter->second.fsize >= 0) {
+#ifdef DEBUG
+            fprintf(stderr, "abandon file data  filename: %s, size: %d\n", fileIter->second.filename.c_str(), static_cast<int>(fileIter->second.fsize));
+#endif
+            std::shared_ptr<File> file = info.file;
+            std::string fileuuid = info.fileuuid;
+            int64_t size = fileIter->second.fsize;
+            DiskPool::get().submit(fileuuid, [file, size]() {
+                file->truncate(size);
+            }, [this, fileuuid, size]() {
+                std::unique_lock<std::mutex> lock(mutex);
+                auto fileIter = globalFileInfo.find(fileuuid);
+                if (fileIter != globalFileInfo.end() && fileIter->second.fsize < 0 && fileIter->second.hash.empty())
+                    fileIter->second.received = size;
+            });
+            fileIter->second.fsize = -1;
+        }
+    }
+    globalFileClientInfo.erase(clientIter);
     return false;
 }
 
@@ -545,6 +1581,33 @@ void Controller::serialize(std::ofstream& out) {
         ::serialize(out, user.first);
         user.second.serialize(out);
     }
+    // Files follow the users so that upload progress survives a restart.
+    size = globalFileInfo.size();
+    ::serialize(out, size);
+    for (auto& file : globalFileInfo) {
+        ::serialize(out, file.first);
+        file.second.serialize(out);
+        ::serialize(out, file.second.subject);
+        ::serialize(out, file.second.received);
+    }
+    // Then the files kept in the store, by content hash.
+    size = std::count_if(globalFileInfo.begin(), globalFileInfo.end(), [](const std::pair<const std::string, FileInfo>& file) { return !file.second.hash.empty(); });
+    ::serialize(out, size);
+    for (auto& file : globalFileInfo) {
+        if (file.second.hash.empty())
+            continue;
+        ::serialize(out, file.first);
+        ::serialize(out, file.second.hash);
+    }
+    // And the checksums of finished uploads.
+    size = std::count_if(globalFileInfo.begin(), globalFileInfo.end(), [](const std::pair<const std::string, FileInfo>& file) { return file.second.crc >= 0; });
+    ::serialize(out, size);
+    for (auto& file : globalFileInfo) {
+        if (file.second.crc < 0)
+            continue;
+        ::serialize(out, file.first);
+        ::serialize(out, file.second.crc);
+    }
 }
 
 void Controller::deserialize(std::ifstream& in) {
@@ -561,6 +1624,49 @@ void Controller::deserialize(std::ifstream& in) {
         tmpU.deserialize(in);
         globalUserInfo.emplace(tmpS, tmpU);
     }
+    // Older databases end after the users.
+    if (in.peek() == std::ifstream::traits_type::eof())
+        return;
+    size = 0;
+    ::deserialize(in, size);
+    for (int i = 0; i < size; ++i) {
+        std::string tmpS;
+        FileInfo tmpF;
+        ::deserialize(in, tmpS);
+        tmpF.deserialize(in);
+        ::deserialize(in, tmpF.subject);
+        ::deserialize(in, tmpF.received);
+        globalFileInfo.emplace(tmpS, tmpF);
+    }
+    if (in.peek() == std::ifstream::traits_type::eof())
+        return;
+    size = 0;
+    ::deserialize(in, size);
+    for (int i = 0; i < size; ++i) {
+        std::string tmpS;
+        std::string tmpH;
+        ::deserialize(in, tmpS);
+        ::deserialize(in, tmpH);
+        auto fileIter = globalFileInfo.find(tmpS);
+        if (fileIter == globalFileInfo.end())
+            continue;
+        fileIter->second.hash = tmpH;
+        store.addRef(tmpH, fileIter->second.received, fileIter->second.subject);
+        store.setStored(tmpH);
+    }
+    if (in.peek() == std::ifstream::traits_type::eof())
+        return;
+    size = 0;
+    ::deserialize(in, size);
+    for (int i = 0; i < size; ++i) {
+        std::string tmpS;
+        int64_t tmpC = -1;
+        ::deserialize(in, tmpS);
+        ::deserialize(in, tmpC);
+        auto fileIter = globalFileInfo.find(tmpS);
+        if (fileIter != globalFileInfo.end())
+            fileIter->second.crc = tmpC;
+    }
 }
 
 #endif //SERVER_CONTROLLER_H
@@ -0,0 +1,74 @@
+#ifndef SERVER_CRC32C_H
+#define SERVER_CRC32C_H
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SERVER_CRC32C_SSE42
+#include <nmmintrin.h>
+#endif
+
+// CRC32C (Castagnoli) that can be extended chunk by chunk, starting from 0.
+// Uses the SSE4.2 crc32 instruction when the CPU has it.
+class Crc32c {
+public:
+    static uint32_t extend(uint32_t crc, const void *data, unsigned long n);
+private:
+    static uint32_t extendTable(uint32_t crc, const uint8_t *p, unsigned long n);
+#ifdef SERVER_CRC32C_SSE42
+    __attribute__((target("sse4.2"))) static uint32_t extendSse42(uint32_t crc, const uint8_t *p, unsigned long n);
+#endif
+};
+
+uint32_t Crc32c::extend(uint32_t crc, const void *data, unsigned long n) {
+    const uint8_t *p = static_cast<const uint8_t*>(data);
+#ifdef SERVER_CRC32C_SSE42
+    static const bool sse42 = __builtin_cpu_supports("sse4.2");
+    if (sse42)
+        return ~extendSse42(~crc, p, n);
+#endif
+    return ~extendTable(~crc, p, n);
+}
+
+uint32_t Crc32c::extendTable(uint32_t crc, const uint8_t *p, unsigned long n) {
+    struct Table {
+        uint32_t entries[256];
+        Table() {
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int j = 0; j < 8; ++j)
+                    c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+                entries[i] = c;
+            }
+        }
+    };
+    static const Table table;
+    for (unsigned long i = 0; i < n; ++i)
+        crc = table.entries[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef SERVER_CRC32C_SSE42
+uint32_t Crc32c::extendSse42(uint32_t crc, const uint8_t *p, unsigned long n) {
+#ifdef __x86_64__
+    uint64_t c = crc;
+    for (; n >= 8; n = n - 8, p = p + 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = static_cast<uint32_t>(c);
+#endif
+    for (; n >= 4; n = n - 4, p = p + 4) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        crc = _mm_crc32_u32(crc, v);
+    }
+    for (; n > 0; --n, ++p)
+        crc = _mm_crc32_u8(crc, *p);
+    return crc;
+}
+#endif
+
+#endif //SERVER_CRC32C_H
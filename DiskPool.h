@@ -0,0 +1,153 @@
+#ifndef SERVER_DISKPOOL_H
+#define SERVER_DISKPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Constant.h"
+#include "Stats.h"
+
+// Threads that run file I/O away from the event loops and the Controller
+// lock. A job runs, then its done callback, both on the worker its key maps
+// to; so jobs and callbacks for one file run in the order they were
+// submitted.
+class DiskPool {
+public:
+    typedef std::function<void()> Task;
+
+    static DiskPool& get();
+
+    DiskPool(const DiskPool&) = delete;
+    DiskPool& operator=(const DiskPool&) = delete;
+
+    void start(unsigned int num);
+    unsigned int getThreadNum() const;
+    void submit(const std::string& key, Task job, Task done = Task());
+private:
+    struct Job {
+        Task job;
+        Task done;
+    };
+
+    struct Worker {
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::deque<Job> jobs;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    DiskPool();
+
+    static void run(Worker *worker);
+};
+
+DiskPool::DiskPool() {}
+
+DiskPool& DiskPool::get() {
+    static DiskPool pool;
+    return pool;
+}
+
+// The workers live as long as the process.
+void DiskPool::start(unsigned int num) {
+    if (num == 0)
+        num = 1;
+    for (unsigned int i = 0; i < num; ++i) {
+        workers.emplace_back(new Worker());
+        std::thread(run, workers.back().get()).detach();
+    }
+}
+
+unsigned int DiskPool::getThreadNum() const {
+    return workers.size();
+}
+
+// Callers may hold locks that done takes, so there is always at least one
+// worker once start() ran.
+void DiskPool::submit(const std::string& key, Task job, Task done) {
+    Worker *worker = workers[std::hash<std::string>()(key) % workers.size()].get();
+    ++Stats::get().diskJobs;
+    std::unique_lock<std::mutex> lock(worker->mutex);
+    worker->jobs.push_back(Job{std::move(job), std::move(done)});
+    lock.unlock();
+    worker->cond.notify_one();
+}
+
+void DiskPool::run(Worker *worker) {
+    while (true) {
+        std::unique_lock<std::mutex> lock(worker->mutex);
+        worker->cond.wait(lock, [worker]() { return !worker->jobs.empty(); });
+        Job job = std::move(worker->jobs.front());
+        worker->jobs.pop_front();
+        lock.unlock();
+        if (job.job)
+            job.job();
+        if (job.done)
+            job.done();
+        --Stats::get().diskJobs;
+    }
+}
+
+// Upload bytes one connection has handed to the disk pool that are not
+// written yet. The connection stops reading above DISKHIGHWATERMARK and arms
+// the notifier, which a job calls once it brings the bytes down to
+// DISKLOWWATERMARK.
+class DiskBacklog {
+public:
+    DiskBacklog();
+
+    DiskBacklog(const DiskBacklog&) = delete;
+    DiskBacklog& operator=(const DiskBacklog&) = delete;
+
+    // Set before the first job is submitted; it runs on a disk thread.
+    void setNotifier(std::function<void()> notifier);
+    unsigned long getBytes() const;
+    void add(unsigned long n);
+    void remove(unsigned long n);
+    // Returns false if the bytes are low already, and nothing is armed then.
+    bool notifyWhenLow();
+private:
+    std::atomic<unsigned long> bytes;
+    std::atomic<bool> waiting;
+    std::function<void()> notifier;
+};
+
+DiskBacklog::DiskBacklog() : bytes(0), waiting(false) {}
+
+void DiskBacklog::setNotifier(std::function<void()> notifier) {
+    this->notifier = std::move(notifier);
+}
+
+unsigned long DiskBacklog::getBytes() const {
+    return bytes;
+}
+
+void DiskBacklog::add(unsigned long n) {
+    bytes += n;
+    Stats::get().diskBacklogBytes += n;
+}
+
+void DiskBacklog::remove(unsigned long n) {
+    unsigned long left = bytes -= n;
+    Stats::get().diskBacklogBytes -= n;
+    if (left <= DISKLOWWATERMARK && waiting.exchange(false) && notifier)
+        notifier();
+}
+
+// Armed before the check, so a job finishing in between still notifies.
+bool DiskBacklog::notifyWhenLow() {
+    waiting = true;
+    if (bytes > DISKLOWWATERMARK)
+        return true;
+    waiting = false;
+    return false;
+}
+
+#endif //SERVER_DISKPOOL_H
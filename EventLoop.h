@@ -0,0 +1,227 @@
+#ifndef SERVER_EVENTLOOP_H
+#define SERVER_EVENTLOOP_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+class EventLoop {
+public:
+    typedef std::function<void(uint32_t)> EventCallback;
+    typedef std::function<void()> Task;
+
+    EventLoop();
+    ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    bool isOpen() const;
+    bool isInLoopThread() const;
+
+    bool add(int fd, uint32_t events, EventCallback callback);
+    bool modify(int fd, uint32_t events);
+    bool remove(int fd);
+
+    void queueInLoop(Task task);
+    void loop();
+    void stop();
+private:
+    int epollfd;
+    int wakeupfd;
+    std::atomic<bool> running;
+    std::thread::id threadId;
+    std::map<int, std::shared_ptr<EventCallback>> callbacks;
+    std::mutex taskMutex;
+    std::vector<Task> tasks;
+
+    void wakeup();
+    void runTasks();
+};
+
+EventLoop::EventLoop() : epollfd(::epoll_create1(EPOLL_CLOEXEC)), wakeupfd(::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), running(true), threadId(std::this_thread::get_id()) {
+    if (epollfd >= 0 && wakeupfd >= 0) {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = wakeupfd;
+        ::epoll_ctl(epollfd, EPOLL_CTL_ADD, wakeupfd, &event);
+    }
+}
+
+EventLoop::~EventLoop() {
+    if (wakeupfd >= 0)
+        ::close(wakeupfd);
+    if (epollfd >= 0)
+        ::close(epollfd);
+}
+
+bool EventLoop::isOpen() const {
+    return epollfd >= 0 && wakeupfd >= 0;
+}
+
+bool EventLoop::isInLoopThread() const {
+    return threadId == std::this_thread::get_id();
+}
+
+bool EventLoop::add(int fd, uint32_t events, EventCallback callback) {
+    epoll_event event = {};
+    event.events = events;
+    event.data.fd = fd;
+    if (::epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) == -1)
+        return false;
+    callbacks[fd] = std::make_shared<EventCallback>(std::move(callback));
+    return true;
+}
+
+bool EventLoop::modify(int fd, uint32_t events) {
+    epoll_event event = {};
+    event.events = events;
+    event.data.fd = fd;
+    return ::epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event) != -1;
+}
+
+bool EventLoop::remove(int fd) {
+    callbacks.erase(fd);
+    return ::epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, nullptr) != -1;
+}
+
+void EventLoop::queueInLoop(Task task) {
+    {
+        std::unique_lock<std::mutex> lock(taskMutex);
+        tasks.push_back(std::move(task));
+    }
+    wakeup();
+}
+
+void EventLoop::loop() {
+    threadId = std::this_thread::get_id();
+    epoll_event events[128];
+    while (running) {
+        int n = ::epoll_wait(epollfd, events, 128, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            if (fd == wakeupfd) {
+                uint64_t count;
+                while (::read(wakeupfd, &count, sizeof(count)) > 0);
+                continue;
+            }
+            auto iter = callbacks.find(fd);
+            if (iter == callbacks.end())
+                continue;
+            std::shared_ptr<EventCallback> callback = iter->second;
+            (*callback)(events[i].events);
+        }
+        runTasks();
+    }
+}
+
+void EventLoop::stop() {
+    running = false;
+    wakeup();
+}
+
+void EventLoop::wakeup() {
+    uint64_t one = 1;
+    ssize_t ret = ::write(wakeupfd, &one, sizeof(one));
+    (void)ret;
+}
+
+void EventLoop::runTasks() {
+    std::vector<Task> current;
+    {
+        std::unique_lock<std::mutex> lock(taskMutex);
+        current.swap(tasks);
+    }
+    for (auto& task : current)
+        task();
+}
+
+class EventLoopPool {
+public:
+    explicit EventLoopPool(unsigned int num);
+    ~EventLoopPool();
+
+    EventLoopPool(const EventLoopPool&) = delete;
+    EventLoopPool& operator=(const EventLoopPool&) = delete;
+
+    bool isOpen() const;
+    unsigned int getLoopNum() const;
+    EventLoop* getLoop(unsigned int index);
+    EventLoop* getNextLoop();
+
+    void start();
+    void stop();
+    void join();
+private:
+    std::vector<std::unique_ptr<EventLoop>> loops;
+    std::vector<std::thread> threads;
+    std::atomic<unsigned int> next;
+};
+
+EventLoopPool::EventLoopPool(unsigned int num) : next(0) {
+    if (num == 0)
+        num = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned int i = 0; i < num; ++i)
+        loops.emplace_back(new EventLoop());
+}
+
+EventLoopPool::~EventLoopPool() {
+    stop();
+}
+
+bool EventLoopPool::isOpen() const {
+    for (const auto& loop : loops)
+        if (!loop->isOpen())
+            return false;
+    return true;
+}
+
+unsigned int EventLoopPool::getLoopNum() const {
+    return loops.size();
+}
+
+EventLoop* EventLoopPool::getLoop(unsigned int index) {
+    return loops[index % loops.size()].get();
+}
+
+EventLoop* EventLoopPool::getNextLoop() {
+    return getLoop(next++);
+}
+
+void EventLoopPool::start() {
+    for (auto& loop : loops) {
+        EventLoop *l = loop.get();
+        threads.emplace_back([l]() {
+            l->loop();
+        });
+    }
+}
+
+void EventLoopPool::stop() {
+    for (auto& loop : loops)
+        loop->stop();
+    join();
+}
+
+void EventLoopPool::join() {
+    for (auto& thread : threads)
+        if (thread.joinable())
+            thread.join();
+    threads.clear();
+}
+
+#endif //SERVER_EVENTLOOP_H
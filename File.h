@@ -0,0 +1,90 @@
+#ifndef SERVER_FILE_H
+#define SERVER_FILE_H
+
+#include <cstdint>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "IoBackend.h"
+
+class File {
+public:
+    File();
+    ~File();
+
+    File(const File&) = delete;
+    File& operator=(const File&) = delete;
+
+    bool open(const std::string& path, int flags, mode_t mode = 0644);
+    bool isOpen() const;
+    int getFd() const;
+    int64_t getSize() const;
+
+    ssize_t pread(void *buf, size_t n, off_t offset);
+    ssize_t pwrite(const void *buf, size_t n, off_t offset);
+    bool allocate(int64_t size);
+    bool truncate(int64_t size);
+    bool close();
+private:
+    int fd;
+};
+
+File::File() : fd(-1) {}
+
+File::~File() {
+    close();
+}
+
+bool File::open(const std::string& path, int flags, mode_t mode) {
+    close();
+    fd = ::open(path.c_str(), flags | O_CLOEXEC, mode);
+    return fd >= 0;
+}
+
+bool File::isOpen() const {
+    return fd >= 0;
+}
+
+int File::getFd() const {
+    return fd;
+}
+
+int64_t File::getSize() const {
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) == -1)
+        return -1;
+    return st.st_size;
+}
+
+ssize_t File::pread(void *buf, size_t n, off_t offset) {
+    return IoBackend::get().pread(fd, buf, n, offset);
+}
+
+ssize_t File::pwrite(const void *buf, size_t n, off_t offset) {
+    return IoBackend::get().pwrite(fd, buf, n, offset);
+}
+
+// Reserves the blocks up front; filesystems without fallocate() just grow
+// the file as it is written.
+bool File::allocate(int64_t size) {
+    if (fd < 0 || size <= 0)
+        return false;
+    return ::fallocate(fd, 0, 0, size) != -1;
+}
+
+bool File::truncate(int64_t size) {
+    if (fd < 0)
+        return false;
+    return ::ftruncate(fd, size) != -1;
+}
+
+bool File::close() {
+    if (fd < 0)
+        return true;
+    bool ret = ::close(fd) != -1;
+    fd = -1;
+    return ret;
+}
+
+#endif //SERVER_FILE_H
@@ -0,0 +1,237 @@
+#ifndef SERVER_FILESTORE_H
+#define SERVER_FILESTORE_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "Constant.h"
+#include "File.h"
+#include "Sha256.h"
+
+// Files on disk, spread over one or more roots and two levels of hex
+// directories below each: root/ab/cd/name. Finished uploads are kept once
+// per content hash and shared by every FileInfo that carries the hash;
+// uploads in progress live next to them under a hash of their uuid. Each
+// object remembers its size and which users hold references to it.
+// The references are not thread safe; the Controller locks around them.
+// commit(), remove() and move() only touch the disk and are called without
+// the lock, from the disk pool.
+class FileStore {
+public:
+    explicit FileStore(const std::vector<std::string>& roots);
+
+    bool open();
+    std::string getPath(const std::string& hash) const;
+    std::string getUploadPath(const std::string& fileuuid) const;
+    bool createParent(const std::string& path) const;
+    void scan(std::map<std::string, std::string>& files) const;
+    static bool isStoreName(const std::string& name);
+
+    bool contains(const std::string& hash) const;
+    int64_t getSize(const std::string& hash) const;
+    bool isOwner(const std::string& hash, const std::string& owner) const;
+    void addRef(const std::string& hash, int64_t size, const std::string& owner);
+    void setStored(const std::string& hash);
+    bool release(const std::string& hash, const std::string& owner);
+    bool commit(const std::string& path, const std::string& hash) const;
+    bool remove(const std::string& hash) const;
+    bool move(const std::string& from, const std::string& to) const;
+private:
+    struct Object {
+        int64_t size;
+        int64_t refs; // FileInfo entries using it, and commits still running
+        bool stored; // its file is on disk
+        std::map<std::string, int64_t> owners; // key: username, value: their share of refs
+        Object() : size(0), refs(0), stored(false) {}
+    };
+
+    std::vector<std::string> roots;
+    std::map<std::string, Object> objects; // key: hash
+
+    std::string getShardPath(const std::string& key, const std::string& name) const;
+    static void scanDir(const std::string& dir, int depth, std::map<std::string, std::string>& files);
+    static bool copy(const std::string& from, const std::string& to);
+};
+
+FileStore::FileStore(const std::vector<std::string>& roots) : roots(roots) {}
+
+bool FileStore::open() {
+    for (const auto& root : roots) {
+        if (::mkdir(root.c_str(), 0755) == -1 && errno != EEXIST) {
+            fprintf(stderr, "Error: can't create file store: %s\n", root.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+// The root comes from other digits of the key than the directories, so
+// every root uses all of its directories.
+std::string FileStore::getShardPath(const std::string& key, const std::string& name) const {
+    unsigned long root = std::stoul(key.substr(4, 4), nullptr, 16) % roots.size();
+    return roots[root] + "/" + key.substr(0, 2) + "/" + key.substr(2, 2) + "/" + name;
+}
+
+std::string FileStore::getPath(const std::string& hash) const {
+    return getShardPath(hash, hash);
+}
+
+// Named after the uuid's hash too, which keeps client chosen uuids out of
+// the path.
+std::string FileStore::getUploadPath(const std::string& fileuuid) const {
+    Sha256 sha;
+    sha.update(fileuuid.data(), fileuuid.size());
+    std::string key = sha.finish();
+    return getShardPath(key, key + ".upload");
+}
+
+bool FileStore::createParent(const std::string& path) const {
+    std::string::size_type second = path.rfind('/');
+    std::string::size_type first = path.rfind('/', second - 1);
+    if (::mkdir(path.substr(0, first).c_str(), 0755) == -1 && errno != EEXIST)
+        return false;
+    return ::mkdir(path.substr(0, second).c_str(), 0755) != -1 || errno == EEXIST;
+}
+
+// Lists all files under the roots by name, one thread per root so that
+// roots on separate disks are read in parallel.
+void FileStore::scan(std::map<std::string, std::string>& files) const {
+    std::vector<std::map<std::string, std::string>> found(roots.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < roots.size(); ++i)
+        threads.emplace_back([this, i, &found]() { scanDir(roots[i], 2, found[i]); });
+    for (auto& thread : threads)
+        thread.join();
+    for (const auto& f : found)
+        files.insert(f.begin(), f.end());
+}
+
+void FileStore::scanDir(const std::string& dir, int depth, std::map<std::string, std::string>& files) {
+    DIR *d = ::opendir(dir.c_str());
+    if (d == nullptr)
+        return;
+    while (struct dirent *entry = ::readdir(d)) {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (depth > 0)
+            scanDir(dir + "/" + entry->d_name, depth - 1, files);
+        else
+            files.emplace(entry->d_name, dir + "/" + entry->d_name);
+    }
+    ::closedir(d);
+}
+
+// Whether the name is one the store gives its files: a content hash, or the
+// hash of an upload's uuid with the .upload suffix.
+bool FileStore::isStoreName(const std::string& name) {
+    static const std::string suffix = ".upload";
+    std::string::size_type len = name.size();
+    if (len == 64 + suffix.size() && name.compare(64, suffix.size(), suffix) == 0)
+        len = 64;
+    if (len != 64)
+        return false;
+    return std::all_of(name.begin(), name.begin() + len, [](char c) { return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'); });
+}
+
+// Only objects whose file is on disk count; a commit still running may fail.
+bool FileStore::contains(const std::string& hash) const {
+    auto iter = objects.find(hash);
+    return iter != objects.end() && iter->second.stored;
+}
+
+int64_t FileStore::getSize(const std::string& hash) const {
+    auto iter = objects.find(hash);
+    return iter == objects.end() ? -1 : iter->second.size;
+}
+
+bool FileStore::isOwner(const std::string& hash, const std::string& owner) const {
+    auto iter = objects.find(hash);
+    return iter != objects.end() && iter->second.owners.find(owner) != iter->second.owners.end();
+}
+
+void FileStore::addRef(const std::string& hash, int64_t size, const std::string& owner) {
+    Object& object = objects[hash];
+    object.size = size;
+    ++object.refs;
+    ++object.owners[owner];
+}
+
+void FileStore::setStored(const std::string& hash) {
+    auto iter = objects.find(hash);
+    if (iter != objects.end())
+        iter->second.stored = true;
+}
+
+// Returns true when that was the last reference; the caller deletes the
+// object with remove() then.
+bool FileStore::release(const std::string& hash, const std::string& owner) {
+    auto iter = objects.find(hash);
+    if (iter == objects.end())
+        return false;
+    auto ownerIter = iter->second.owners.find(owner);
+    if (ownerIter != iter->second.owners.end() && --ownerIter->second == 0)
+        iter->second.owners.erase(ownerIter);
+    if (--iter->second.refs > 0)
+        return false;
+    objects.erase(iter);
+    return true;
+}
+
+// Makes the finished upload at path the object for hash, unless the object
+// is on disk already. The upload keeps its own name: the object is a second
+// link to it, or a copy when the roots are on different filesystems.
+bool FileStore::commit(const std::string& path, const std::string& hash) const {
+    std::string to = getPath(hash);
+    if (::access(to.c_str(), F_OK) == 0)
+        return true;
+    if (!createParent(to))
+        return false;
+    if (::link(path.c_str(), to.c_str()) == 0)
+        return true;
+    return errno == EXDEV && copy(path, to);
+}
+
+bool FileStore::remove(const std::string& hash) const {
+    return ::unlink(getPath(hash).c_str()) == 0;
+}
+
+// Renames the file, or copies it over when the roots are on different
+// filesystems.
+bool FileStore::move(const std::string& from, const std::string& to) const {
+    if (!createParent(to))
+        return false;
+    if (::rename(from.c_str(), to.c_str()) == 0)
+        return true;
+    if (errno != EXDEV || !copy(from, to))
+        return false;
+    ::unlink(from.c_str());
+    return true;
+}
+
+bool FileStore::copy(const std::string& from, const std::string& to) {
+    File in;
+    File out;
+    if (!in.open(from, O_RDONLY) || !out.open(to, O_WRONLY | O_CREAT | O_TRUNC))
+        return false;
+    char tmp[FILEBLOCKSIZE];
+    off_t offset = 0;
+    ssize_t n;
+    while ((n = in.pread(tmp, sizeof(tmp), offset)) > 0 && out.pwrite(tmp, n, offset) == n)
+        offset = offset + n;
+    if (n != 0) {
+        ::unlink(to.c_str());
+        return false;
+    }
+    return true;
+}
+
+#endif //SERVER_FILESTORE_H
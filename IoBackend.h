@@ -0,0 +1,344 @@
+#ifndef SERVER_IOBACKEND_H
+#define SERVER_IOBACKEND_H
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// offset -1 reads or writes at the current file position. Socket requests
+// never wait for readiness, they complete with -EAGAIN instead.
+struct IoRequest {
+    enum Op { READV, WRITEV, RECVMSG, SENDMSG };
+
+    Op op;
+    int fd;
+    const iovec *iov;
+    int iovcnt;
+    off_t offset;
+    ssize_t result;
+    msghdr msg;
+
+    IoRequest(Op o, int f, const iovec *i, int n, off_t off);
+};
+
+class IoBackend {
+public:
+    enum Type { BLOCKING, URING };
+
+    virtual ~IoBackend() {}
+
+    virtual Type getType() const = 0;
+    virtual const char* getName() const = 0;
+    // Runs every request and stores the syscall-style return value in result.
+    virtual void submit(IoRequest *requests, int n) = 0;
+
+    ssize_t recv(int fd, void *buf, size_t n);
+    ssize_t recvv(int fd, const iovec *iov, int iovcnt);
+    ssize_t sendv(int fd, const iovec *iov, int iovcnt);
+    ssize_t pread(int fd, void *buf, size_t n, off_t offset);
+    ssize_t pwrite(int fd, const void *buf, size_t n, off_t offset);
+
+    static Type select(Type type);
+    static Type getSelected();
+    static IoBackend& get();
+private:
+    static std::atomic<int> selected;
+
+    ssize_t submitOne(IoRequest::Op op, int fd, const iovec *iov, int iovcnt, off_t offset);
+};
+
+class BlockingIoBackend : public IoBackend {
+public:
+    Type getType() const override;
+    const char* getName() const override;
+    void submit(IoRequest *requests, int n) override;
+};
+
+class UringIoBackend : public IoBackend {
+public:
+    UringIoBackend();
+    ~UringIoBackend();
+
+    UringIoBackend(const UringIoBackend&) = delete;
+    UringIoBackend& operator=(const UringIoBackend&) = delete;
+
+    bool isOpen() const;
+    Type getType() const override;
+    const char* getName() const override;
+    void submit(IoRequest *requests, int n) override;
+private:
+    static const unsigned ENTRIES = 64;
+
+    int ringfd;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    io_uring_sqe *sqes;
+    size_t sqesSize;
+
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned sqEntries;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    io_uring_cqe *cqes;
+
+    void release();
+    int reap();
+};
+
+IoRequest::IoRequest(Op o, int f, const iovec *i, int n, off_t off) : op(o), fd(f), iov(i), iovcnt(n), offset(off), result(0) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = const_cast<iovec*>(i);
+    msg.msg_iovlen = n;
+}
+
+std::atomic<int> IoBackend::selected(IoBackend::BLOCKING);
+
+ssize_t IoBackend::submitOne(IoRequest::Op op, int fd, const iovec *iov, int iovcnt, off_t offset) {
+    IoRequest request(op, fd, iov, iovcnt, offset);
+    submit(&request, 1);
+    if (request.result < 0) {
+        errno = -request.result;
+        return -1;
+    }
+    return request.result;
+}
+
+ssize_t IoBackend::recv(int fd, void *buf, size_t n) {
+    iovec iov = {buf, n};
+    return submitOne(IoRequest::RECVMSG, fd, &iov, 1, -1);
+}
+
+ssize_t IoBackend::recvv(int fd, const iovec *iov, int iovcnt) {
+    return submitOne(IoRequest::RECVMSG, fd, iov, iovcnt, -1);
+}
+
+ssize_t IoBackend::sendv(int fd, const iovec *iov, int iovcnt) {
+    return submitOne(IoRequest::SENDMSG, fd, iov, iovcnt, -1);
+}
+
+ssize_t IoBackend::pread(int fd, void *buf, size_t n, off_t offset) {
+    iovec iov = {buf, n};
+    return submitOne(IoRequest::READV, fd, &iov, 1, offset);
+}
+
+ssize_t IoBackend::pwrite(int fd, const void *buf, size_t n, off_t offset) {
+    iovec iov = {const_cast<void*>(buf), n};
+    return submitOne(IoRequest::WRITEV, fd, &iov, 1, offset);
+}
+
+IoBackend::Type IoBackend::select(Type type) {
+    if (type == URING && !UringIoBackend().isOpen())
+        type = BLOCKING;
+    selected = type;
+    return type;
+}
+
+IoBackend::Type IoBackend::getSelected() {
+    return static_cast<Type>(selected.load());
+}
+
+IoBackend& IoBackend::get() {
+    static thread_local std::unique_ptr<IoBackend> backend;
+    if (!backend) {
+        if (getSelected() == URING) {
+            std::unique_ptr<UringIoBackend> uring(new UringIoBackend());
+            if (uring->isOpen())
+                backend = std::move(uring);
+        }
+        if (!backend)
+            backend.reset(new BlockingIoBackend());
+    }
+    return *backend;
+}
+
+IoBackend::Type BlockingIoBackend::getType() const {
+    return BLOCKING;
+}
+
+const char* BlockingIoBackend::getName() const {
+    return "blocking";
+}
+
+void BlockingIoBackend::submit(IoRequest *requests, int n) {
+    for (int i = 0; i < n; ++i) {
+        IoRequest& r = requests[i];
+        ssize_t ret;
+        do {
+            switch (r.op) {
+                case IoRequest::READV:
+                    ret = r.offset >= 0 ? ::preadv(r.fd, r.iov, r.iovcnt, r.offset) : ::readv(r.fd, r.iov, r.iovcnt);
+                    break;
+                case IoRequest::WRITEV:
+                    ret = r.offset >= 0 ? ::pwritev(r.fd, r.iov, r.iovcnt, r.offset) : ::writev(r.fd, r.iov, r.iovcnt);
+                    break;
+                case IoRequest::RECVMSG:
+                    ret = ::recvmsg(r.fd, &r.msg, MSG_DONTWAIT);
+                    break;
+                default:
+                    ret = ::sendmsg(r.fd, &r.msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+                    break;
+            }
+        } while (ret < 0 && errno == EINTR);
+        r.result = ret < 0 ? -errno : ret;
+    }
+}
+
+UringIoBackend::UringIoBackend() : ringfd(-1), sqRing(MAP_FAILED), sqRingSize(0), cqRing(MAP_FAILED), cqRingSize(0), sqes(static_cast<io_uring_sqe*>(MAP_FAILED)), sqesSize(0) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringfd = static_cast<int>(::syscall(__NR_io_uring_setup, ENTRIES, &params));
+    if (ringfd < 0)
+        return;
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap && cqRingSize > sqRingSize)
+        sqRingSize = cqRingSize;
+    sqRing = ::mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) {
+        release();
+        return;
+    }
+    if (singleMmap) {
+        cqRing = sqRing;
+    } else {
+        cqRing = ::mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) {
+            release();
+            return;
+        }
+    }
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe*>(::mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES));
+    if (sqes == MAP_FAILED) {
+        release();
+        return;
+    }
+    char *sq = static_cast<char*>(sqRing);
+    char *cq = static_cast<char*>(cqRing);
+    sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sqEntries = params.sq_entries;
+    cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+}
+
+UringIoBackend::~UringIoBackend() {
+    release();
+}
+
+void UringIoBackend::release() {
+    if (sqes != MAP_FAILED)
+        ::munmap(sqes, sqesSize);
+    if (cqRing != MAP_FAILED && cqRing != sqRing)
+        ::munmap(cqRing, cqRingSize);
+    if (sqRing != MAP_FAILED)
+        ::munmap(sqRing, sqRingSize);
+    sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    cqRing = MAP_FAILED;
+    sqRing = MAP_FAILED;
+    if (ringfd >= 0)
+        ::close(ringfd);
+    ringfd = -1;
+}
+
+bool UringIoBackend::isOpen() const {
+    return ringfd >= 0;
+}
+
+IoBackend::Type UringIoBackend::getType() const {
+    return URING;
+}
+
+const char* UringIoBackend::getName() const {
+    return "io_uring";
+}
+
+int UringIoBackend::reap() {
+    int count = 0;
+    unsigned head = __atomic_load_n(cqHead, __ATOMIC_RELAXED);
+    while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+        io_uring_cqe& cqe = cqes[head & *cqMask];
+        reinterpret_cast<IoRequest*>(cqe.user_data)->result = cqe.res;
+        ++head;
+        ++count;
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+void UringIoBackend::submit(IoRequest *requests, int n) {
+    while (n > 0) {
+        unsigned batch = static_cast<unsigned>(n) < sqEntries ? n : sqEntries;
+        unsigned tail = __atomic_load_n(sqTail, __ATOMIC_RELAXED);
+        for (unsigned i = 0; i < batch; ++i) {
+            IoRequest& r = requests[i];
+            unsigned index = tail & *sqMask;
+            io_uring_sqe& sqe = sqes[index];
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.fd = r.fd;
+            switch (r.op) {
+                case IoRequest::READV:
+                case IoRequest::WRITEV:
+                    sqe.opcode = r.op == IoRequest::READV ? IORING_OP_READV : IORING_OP_WRITEV;
+                    sqe.addr = reinterpret_cast<uint64_t>(r.iov);
+                    sqe.len = r.iovcnt;
+                    sqe.off = r.offset;
+                    break;
+                default:
+                    sqe.opcode = r.op == IoRequest::RECVMSG ? IORING_OP_RECVMSG : IORING_OP_SENDMSG;
+                    sqe.addr = reinterpret_cast<uint64_t>(&r.msg);
+                    sqe.len = 1;
+                    sqe.msg_flags = r.op == IoRequest::RECVMSG ? MSG_DONTWAIT : MSG_DONTWAIT | MSG_NOSIGNAL;
+                    break;
+            }
+            sqe.user_data = reinterpret_cast<uint64_t>(&r);
+            r.result = -EINPROGRESS;
+            sqArray[index] = index;
+            ++tail;
+        }
+        __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+        unsigned start = tail - batch;
+        unsigned completed = 0;
+        while (completed < batch) {
+            unsigned pending = tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+            int ret = static_cast<int>(::syscall(__NR_io_uring_enter, ringfd, pending, batch - completed, IORING_ENTER_GETEVENTS, nullptr, 0));
+            if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                // The entries the kernel hasn't taken yet are taken back and
+                // fail. The ones it has still point at requests, so they are
+                // waited for before returning.
+                int error = errno;
+                unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+                for (unsigned i = head - start; i < tail - start; ++i) {
+                    requests[i].result = -error;
+                    ++completed;
+                }
+                tail = head;
+                __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+            }
+            completed += reap();
+        }
+        requests += batch;
+        n -= batch;
+    }
+}
+
+#endif //SERVER_IOBACKEND_H
@@ -2,6 +2,7 @@
 #define SERVER_JSONREADER_H
 
 #include <vector>
+#include "BufferView.h"
 #include "rapidjson/document.h"
 
 class JsonReader;
@@ -10,9 +11,12 @@ class JsonReader {
 public:
     JsonReader();
     explicit JsonReader(const std::string& str);
+    explicit JsonReader(const BufferView& view);
 
     void parse(const std::string& str);
+    void parse(const BufferView& view);
 
+    bool hasMember(const char* key) const;
     std::string getString(const char* key);
     int64_t getInt64(const char* key);
     template <typename T>
@@ -30,10 +34,22 @@ JsonReader::JsonReader(const std::string& str) {
     parse(str);
 }
 
+JsonReader::JsonReader(const BufferView& view) {
+    parse(view);
+}
+
 void JsonReader::parse(const std::string& str) {
     document.Parse(str.c_str());
 }
 
+void JsonReader::parse(const BufferView& view) {
+    document.Parse(view.data, view.size);
+}
+
+bool JsonReader::hasMember(const char *key) const {
+    return document.IsObject() && document.HasMember(key);
+}
+
 std::string JsonReader::getString(const char *key) {
     return std::string(document[key].GetString());
 }
@@ -0,0 +1,311 @@
+#ifndef SERVER_MIRROREDREADRINGBUFFER_H
+#define SERVER_MIRROREDREADRINGBUFFER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "BufferView.h"
+
+// Same interface as ReadRingBuffer, but the SIZE bytes of storage are mapped
+// twice back-to-back, so every readable or writable region is contiguous in
+// memory and no operation has to split at the wrap point.
+template <unsigned long SIZE>
+class MirroredReadRingBuffer {
+    static_assert(SIZE % 4096 == 0, "MirroredReadRingBuffer size must be a multiple of the page size");
+public:
+    MirroredReadRingBuffer();
+    ~MirroredReadRingBuffer();
+
+    MirroredReadRingBuffer(const MirroredReadRingBuffer&) = delete;
+    MirroredReadRingBuffer& operator=(const MirroredReadRingBuffer&) = delete;
+
+    unsigned long getSize() const;
+    unsigned long getOccupancy() const;
+    unsigned long getCapacity() const;
+
+    std::string getAllData();
+    uint8_t getUInt8();
+    void putUInt8(uint8_t);
+    int8_t getInt8();
+    void putInt8(int8_t);
+    uint16_t getUInt16LE();
+    void putUInt16LE(uint16_t);
+    int16_t getInt16LE();
+    void putInt16LE(int16_t);
+    uint32_t getUInt32LE();
+    void putUInt32LE(uint32_t);
+    int32_t getInt32LE();
+    void putInt32LE(int32_t);
+    uint64_t getUInt64LE();
+    void putUInt64LE(uint64_t);
+    int64_t getInt64LE();
+    void putInt64LE(int64_t);
+    std::string getString(unsigned long n);
+    void putString(const std::string& str);
+    void getCharArray(char *arr, unsigned long n);
+    void putCharArray(char *arr, unsigned long n);
+
+    uint16_t lookAheadUInt16LE() const;
+    uint32_t lookAheadUInt32LE() const;
+
+    int getWritableSegments(iovec *iov) const;
+    void commitWrite(unsigned long n);
+
+    const char* getReadPointer() const;
+    char* getWritePointer() const;
+    BufferView getView(unsigned long offset, unsigned long n, std::string& scratch) const;
+    void skip(unsigned long n);
+
+private:
+    char *buffer;
+    unsigned long getPos;
+    unsigned long putPos;
+    unsigned long occupancy;
+
+    void addGetPos(unsigned long n);
+    void addPutPos(unsigned long n);
+    template<typename T>
+    T getValue();
+    template<typename T>
+    void putValue(T v);
+};
+
+template<unsigned long SIZE>
+MirroredReadRingBuffer<SIZE>::MirroredReadRingBuffer() : buffer(nullptr), getPos(0), putPos(0), occupancy(0) {
+    int fd = ::memfd_create("ReadRingBuffer", MFD_CLOEXEC);
+    if (fd < 0)
+        throw std::bad_alloc();
+    void *base = MAP_FAILED;
+    if (::ftruncate(fd, SIZE) == 0)
+        base = ::mmap(nullptr, 2 * SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base != MAP_FAILED) {
+        char *b = static_cast<char*>(base);
+        if (::mmap(b, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+            ::mmap(b + SIZE, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            ::munmap(base, 2 * SIZE);
+            base = MAP_FAILED;
+        }
+    }
+    ::close(fd);
+    if (base == MAP_FAILED)
+        throw std::bad_alloc();
+    buffer = static_cast<char*>(base);
+}
+
+template<unsigned long SIZE>
+MirroredReadRingBuffer<SIZE>::~MirroredReadRingBuffer() {
+    if (buffer)
+        ::munmap(buffer, 2 * SIZE);
+}
+
+template<unsigned long SIZE>
+void MirroredReadRingBuffer<SIZE>::addGetPos(unsigned long n) {
+    getPos = getPos + n;
+    occupancy = occupancy - n;
+    if (getPos >= SIZE)
+        getPos = getPos - SIZE;
+}
+
+template<unsigned long SIZE>
+void MirroredReadRingBuffer<SIZE>::addPutPos(unsigned long n) {
+    putPos = putPos + n;
+    occupancy = occupancy + n;
+    if (putPos >= SIZE)
+        putPos = putPos - SIZE;
+}
+
+template<unsigned long SIZE>
+template<typename T>
+T MirroredReadRingBuffer<SIZE>::getValue() {
+    T ret;
+    memcpy(&ret, buffer + getPos, sizeof(T));
+    addGetPos(sizeof(T));
+    return ret;
+}
+
+template<unsigned long SIZE>
+template<typename T>
+void MirroredReadRingBuffer<SIZE>::putValue(T v) {
+    memcpy(buffer + putPos, &v, sizeof(T));
+    addPutPos(sizeof(T));
+}
+
+template<unsigned long SIZE>
+unsigned long MirroredReadRingBuffer<SIZE>::getSize() const {
+    return SIZE;
+}
+
+template<unsigned long SIZE>
+unsigned long MirroredReadRingBuffer<SIZE>::getOccupancy() const {
+    return occupancy;
+}
+
+template<unsigned long SIZE>
+unsigned long MirroredReadRingBuffer<SIZE>::getCapacity() const {
+    return SIZE - occupancy;
+}
+
+template<unsigned long SIZE>
+std::string MirroredReadRingBuffer<SIZE>::getAllData() {
+    return getString(occupancy);
+}
+
+template<unsigned long SIZE>
+uint8_t MirroredReadRingBuffer<SIZE>::getUInt8() {
+    return getValue<uint8_t>();
+}
+
+template<unsigned long SIZE>
+void MirroredReadRingBuffer<SIZE>::putUInt8(uint8_t v) {
+    putValue(v);
+}
+
+template<unsigned long SIZE>
+int8_t MirroredReadRingBuffer<SIZE>::getInt8() {
+    return getValue<int8_t>();
+}
+
+template<unsigned long SIZE>
+void MirroredReadRingBuffer<SIZE>::putInt8(int8_t v) {
+    putValue(v);
+}
+
+template<unsigned long SIZE>
+uint16_t MirroredReadRingBuffer<SIZE>::getUInt16LE() {
+    return getValue<uint16_t>();
+}
+
+template<unsigned long SIZE>
+void MirroredReadRingBuffer<SIZE>::putUInt16LE(uint16_t v) {
+    putValue(v);
+}
+
+template<unsigned long SIZE>
+int16_t MirroredReadRingBuffer<SIZE>::getInt16LE() {
+    return getValue<int16_t>();
+}
+
+template<unsigned long SIZE>
+void MirroredReadRingBuffer<SIZE>::putInt16LE(int16_t v) {
+    putValue(v);
+}
+
+template<unsigned long SIZE>
+uint32_t MirroredReadRingBuffer<SIZE>::getUInt32LE() {
+    return getValue<uint32_t>();
+}
+
+template<unsigned long SIZE>
+void MirroredReadRingBuffer<SIZE>::putUInt32LE(uint32_t v) {
+    putValue(v);
+}
+
+template<unsigned long SIZE>
+int32_t MirroredReadRingBuffer<SIZE>::getInt32LE() {
+    return getValue<int32_t>();
+}
+
+template<unsigned long SIZE>
+void MirroredReadRingBuffer<SIZE>::putInt32LE(int32_t v) {
+    putValue(v);
+}
+
+template<unsigned long SIZE>
+uint64_t MirroredReadRingBuffer<SIZE>::getUInt64LE() {
+    return getValue<uint64_t>();
+}
+
+template<unsigned long SIZE>
+void MirroredReadRingBuffer<SIZE>::putUInt64LE(uint64_t v) {
+    putValue(v);
+}
+
+template<unsigned long SIZE>
+int64_t MirroredReadRingBuffer<SIZE>::getInt64LE() {
+    return getValue<int64_t>();
+}
+
+template<unsigned long SIZE>
+void MirroredReadRingBuffer<SIZE>::putInt64LE(int64_t v) {
+    putValue(v);
+}
+
+template<unsigned long SIZE>
+std::string MirroredReadRingBuffer<SIZE>::getString(unsigned long n) {
+    std::string ret(buffer + getPos, n);
+    addGetPos(n);
+    return ret;
+}
+
+template<unsigned long SIZE>
+void MirroredReadRingBuffer<SIZE>::putString(const std::string& str) {
+    memcpy(buffer + putPos, str.data(), str.size());
+    addPutPos(str.size());
+}
+
+template<unsigned long SIZE>
+void MirroredReadRingBuffer<SIZE>::getCharArray(char *arr, unsigned long n) {
+    memcpy(arr, buffer + getPos, n);
+    addGetPos(n);
+}
+
+template<unsigned long SIZE>
+void MirroredReadRingBuffer<SIZE>::putCharArray(char *arr, unsigned long n) {
+    memcpy(buffer + putPos, arr, n);
+    addPutPos(n);
+}
+
+template<unsigned long SIZE>
+uint16_t MirroredReadRingBuffer<SIZE>::lookAheadUInt16LE() const {
+    uint16_t ret;
+    memcpy(&ret, buffer + getPos, sizeof(uint16_t));
+    return ret;
+}
+
+template<unsigned long SIZE>
+uint32_t MirroredReadRingBuffer<SIZE>::lookAheadUInt32LE() const {
+    uint32_t ret;
+    memcpy(&ret, buffer + getPos, sizeof(uint32_t));
+    return ret;
+}
+
+template<unsigned long SIZE>
+int MirroredReadRingBuffer<SIZE>::getWritableSegments(iovec *iov) const {
+    if (occupancy == SIZE)
+        return 0;
+    iov[0].iov_base = buffer + putPos;
+    iov[0].iov_len = SIZE - occupancy;
+    return 1;
+}
+
+template<unsigned long SIZE>
+void MirroredReadRingBuffer<SIZE>::commitWrite(unsigned long n) {
+    addPutPos(n);
+}
+
+template<unsigned long SIZE>
+const char* MirroredReadRingBuffer<SIZE>::getReadPointer() const {
+    return buffer + getPos;
+}
+
+template<unsigned long SIZE>
+char* MirroredReadRingBuffer<SIZE>::getWritePointer() const {
+    return buffer + putPos;
+}
+
+template<unsigned long SIZE>
+BufferView MirroredReadRingBuffer<SIZE>::getView(unsigned long offset, unsigned long n, std::string&) const {
+    return BufferView(buffer + getPos + offset, n);
+}
+
+template<unsigned long SIZE>
+void MirroredReadRingBuffer<SIZE>::skip(unsigned long n) {
+    addGetPos(n);
+}
+
+#endif //SERVER_MIRROREDREADRINGBUFFER_H
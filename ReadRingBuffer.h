@@ -5,6 +5,8 @@
 #include <cstdint>
 #include <cstring>
 #include <string>
+#include <sys/uio.h>
+#include "BufferView.h"
 
 template <unsigned long SIZE>
 class ReadRingBuffer {
@@ -41,6 +43,13 @@ public:
     uint16_t lookAheadUInt16LE() const;
     uint32_t lookAheadUInt32LE() const;
 
+    int getWritableSegments(iovec *iov) const;
+    void commitWrite(unsigned long n);
+
+    // A frame that straddles the end of the ring is linearized into scratch.
+    BufferView getView(unsigned long offset, unsigned long n, std::string& scratch) const;
+    void skip(unsigned long n);
+
 private:
     char *buffer;
     char *get;
@@ -63,7 +72,7 @@ ReadRingBuffer<SIZE>::ReadRingBuffer() : buffer(new char[SIZE]), occupancy(0) {
 template<unsigned long SIZE>
 ReadRingBuffer<SIZE>::~ReadRingBuffer() {
     if (buffer)
-        delete buffer;
+        delete[] buffer;
 }
 
 template<unsigned long SIZE>
@@ -291,4 +300,44 @@ uint32_t ReadRingBuffer<SIZE>::lookAheadUInt32LE() const {
     return *(uint32_t *)tmp;
 }
 
+template<unsigned long SIZE>
+int ReadRingBuffer<SIZE>::getWritableSegments(iovec *iov) const {
+    unsigned long capacity = SIZE - occupancy;
+    if (capacity == 0)
+        return 0;
+    unsigned long len = buffer + SIZE - put;
+    iov[0].iov_base = put;
+    if (len >= capacity) {
+        iov[0].iov_len = capacity;
+        return 1;
+    }
+    iov[0].iov_len = len;
+    iov[1].iov_base = buffer;
+    iov[1].iov_len = capacity - len;
+    return 2;
+}
+
+template<unsigned long SIZE>
+void ReadRingBuffer<SIZE>::commitWrite(unsigned long n) {
+    addPutPos(n);
+}
+
+template<unsigned long SIZE>
+BufferView ReadRingBuffer<SIZE>::getView(unsigned long offset, unsigned long n, std::string& scratch) const {
+    char *cur = get + offset;
+    if (cur >= buffer + SIZE)
+        cur = cur - SIZE;
+    unsigned long len = buffer + SIZE - cur;
+    if (len >= n)
+        return BufferView(cur, n);
+    scratch.assign(cur, len);
+    scratch.append(buffer, n - len);
+    return BufferView(scratch);
+}
+
+template<unsigned long SIZE>
+void ReadRingBuffer<SIZE>::skip(unsigned long n) {
+    addGetPos(n);
+}
+
 #endif //SERVER_READRINGBUFFER_H
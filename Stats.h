@@ -0,0 +1,61 @@
+#ifndef SERVER_STATS_H
+#define SERVER_STATS_H
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+
+class Stats {
+public:
+    static Stats& get();
+
+    std::atomic<long> connections;
+    std::atomic<long> outboundBytes;
+    std::atomic<long> outboundFrames;
+    std::atomic<long> outboundHighWaterBytes;
+    std::atomic<long> pausedClients;
+    std::atomic<long> droppedClients;
+    std::atomic<long> smallRecvBuffers;
+    std::atomic<long> smallRecvBuffersHighWater;
+    std::atomic<long> largeRecvBuffers;
+    std::atomic<long> largeRecvBuffersHighWater;
+    std::atomic<long> idleRecvBuffers;
+    std::atomic<long> chunkCacheHits;
+    std::atomic<long> chunkCacheMisses;
+    std::atomic<long> chunkCacheBytes;
+    std::atomic<long> diskJobs;
+    std::atomic<long> diskBacklogBytes;
+
+    void updateMax(std::atomic<long>& value, long v);
+    std::string toString() const;
+private:
+    Stats();
+};
+
+Stats::Stats() : connections(0), outboundBytes(0), outboundFrames(0), outboundHighWaterBytes(0), pausedClients(0), droppedClients(0),
+                 smallRecvBuffers(0), smallRecvBuffersHighWater(0), largeRecvBuffers(0), largeRecvBuffersHighWater(0), idleRecvBuffers(0),
+                 chunkCacheHits(0), chunkCacheMisses(0), chunkCacheBytes(0), diskJobs(0), diskBacklogBytes(0) {}
+
+Stats& Stats::get() {
+    static Stats stats;
+    return stats;
+}
+
+void Stats::updateMax(std::atomic<long>& value, long v) {
+    long current = value.load();
+    while (current < v && !value.compare_exchange_weak(current, v));
+}
+
+std::string Stats::toString() const {
+    long lookups = chunkCacheHits.load() + chunkCacheMisses.load();
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer), "connections: %ld, outbound bytes: %ld, outbound frames: %ld, outbound high water: %ld, paused clients: %ld, dropped clients: %ld, "
+             "small recv buffers: %ld (high water %ld), large recv buffers: %ld (high water %ld), idle recv buffers: %ld, "
+             "chunk cache hits: %ld, misses: %ld (hit rate %.1f%%), chunk cache bytes: %ld, disk jobs: %ld, disk backlog bytes: %ld",
+             connections.load(), outboundBytes.load(), outboundFrames.load(), outboundHighWaterBytes.load(), pausedClients.load(), droppedClients.load(),
+             smallRecvBuffers.load(), smallRecvBuffersHighWater.load(), largeRecvBuffers.load(), largeRecvBuffersHighWater.load(), idleRecvBuffers.load(),
+             chunkCacheHits.load(), chunkCacheMisses.load(), lookups > 0 ? 100.0 * chunkCacheHits.load() / lookups : 0.0, chunkCacheBytes.load(), diskJobs.load(), diskBacklogBytes.load());
+    return std::string(buffer);
+}
+
+#endif //SERVER_STATS_H
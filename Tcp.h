@@ -1,13 +1,197 @@
 #ifndef SERVER_TCP_H
 #define SERVER_TCP_H
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
 #include <string>
 #include <vector>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <climits>
+#include <memory>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include "DiskPool.h"
+#include "File.h"
+#include "IoBackend.h"
+#include "Stats.h"
+
+struct TcpFrame {
+    char prefix[sizeof(uint32_t) + sizeof(uint16_t)];
+    std::string header;
+    std::string body;
+    // Optional body taken straight from a file with sendfile() after the
+    // in-memory part has been written.
+    std::shared_ptr<File> file;
+    off_t fileOffset;
+    unsigned long fileLength;
+
+    TcpFrame();
+    explicit TcpFrame(const std::string& h, const std::string& b = std::string());
+    TcpFrame(const std::string& h, const std::shared_ptr<File>& f, off_t offset, unsigned long length);
+
+    unsigned long getSize() const;
+    unsigned long getMemorySize() const;
+    int getIovecs(iovec *iov) const;
+private:
+    void setPrefix();
+};
+
+TcpFrame::TcpFrame() : TcpFrame(std::string()) {}
+
+TcpFrame::TcpFrame(const std::string& h, const std::string& b) : header(h), body(b), fileOffset(0), fileLength(0) {
+    setPrefix();
+}
+
+TcpFrame::TcpFrame(const std::string& h, const std::shared_ptr<File>& f, off_t offset, unsigned long length) : header(h), file(f), fileOffset(offset), fileLength(length) {
+    setPrefix();
+}
+
+void TcpFrame::setPrefix() {
+    uint32_t len = sizeof(uint16_t) + header.size() + body.size() + fileLength;
+    uint16_t headerLen = header.size();
+    memcpy(prefix, &len, sizeof(uint32_t));
+    memcpy(prefix + sizeof(uint32_t), &headerLen, sizeof(uint16_t));
+}
+
+unsigned long TcpFrame::getSize() const {
+    return getMemorySize() + fileLength;
+}
+
+unsigned long TcpFrame::getMemorySize() const {
+    return sizeof(prefix) + header.size() + body.size();
+}
+
+int TcpFrame::getIovecs(iovec *iov) const {
+    iov[0].iov_base = const_cast<char*>(prefix);
+    iov[0].iov_len = sizeof(prefix);
+    iov[1].iov_base = const_cast<char*>(header.data());
+    iov[1].iov_len = header.size();
+    if (body.empty())
+        return 2;
+    iov[2].iov_base = const_cast<char*>(body.data());
+    iov[2].iov_len = body.size();
+    return 3;
+}
+
+// Pipe that stages spliced bytes inside the kernel on their way from a
+// socket to a file. The event loop fills it and disk pool jobs drain it in
+// order, so it counts the bytes in between; it belongs to one upload stream
+// while any are left.
+class SplicePipe {
+public:
+    SplicePipe();
+    ~SplicePipe();
+
+    SplicePipe(const SplicePipe&) = delete;
+    SplicePipe& operator=(const SplicePipe&) = delete;
+
+    // False as well once a drain failed and the pipe's contents are unknown.
+    bool isOpen() const;
+    int getWriteFd() const;
+    unsigned long getSize() const;
+    unsigned long getFree() const;
+    void commitFill(unsigned long n);
+    // Bytes from a socket can take a slot each long before the pipe's size
+    // is used up; the pipe counts as full then until the next drain.
+    void setFull();
+    bool drainTo(int fd, int64_t offset, unsigned long n);
+private:
+    int fds[2];
+    unsigned long size;
+    std::atomic<unsigned long> queued;
+    std::atomic<bool> full;
+    std::atomic<bool> broken;
+};
+
+SplicePipe::SplicePipe() : fds{-1, -1}, size(0), queued(0), full(false), broken(false) {
+    static const int SPLICEPIPESIZE = 1024 * 1024;
+    if (::pipe2(fds, O_CLOEXEC) == -1) {
+        fds[0] = fds[1] = -1;
+        return;
+    }
+    ::fcntl(fds[0], F_SETPIPE_SZ, SPLICEPIPESIZE);
+    int ret = ::fcntl(fds[0], F_GETPIPE_SZ);
+    size = ret > 0 ? ret : 4096;
+}
+
+SplicePipe::~SplicePipe() {
+    if (fds[0] >= 0) {
+        ::close(fds[0]);
+        ::close(fds[1]);
+    }
+}
+
+bool SplicePipe::isOpen() const {
+    return fds[0] >= 0 && !broken;
+}
+
+int SplicePipe::getWriteFd() const {
+    return fds[1];
+}
+
+unsigned long SplicePipe::getSize() const {
+    return size;
+}
+
+unsigned long SplicePipe::getFree() const {
+    unsigned long n = queued;
+    // A drain may have run between the failed fill and setFull().
+    return full && n > 0 ? 0 : size - n;
+}
+
+void SplicePipe::commitFill(unsigned long n) {
+    queued += n;
+}
+
+void SplicePipe::setFull() {
+    full = true;
+}
+
+// Moves the next n bytes of the pipe into fd at offset. If the file refuses
+// splice() the bytes are copied out of the pipe and written instead.
+bool SplicePipe::drainTo(int fd, int64_t offset, unsigned long n) {
+    loff_t off = offset;
+    unsigned long left = n;
+    bool spliced = true;
+    while (left > 0 && spliced) {
+        ssize_t m = ::splice(fds[0], nullptr, fd, &off, left, SPLICE_F_MOVE);
+        if (m < 0 && errno == EINTR)
+            continue;
+        if (m <= 0) {
+            spliced = false;
+            break;
+        }
+        left = left - m;
+    }
+    char tmp[65536];
+    while (left > 0) {
+        ssize_t m = ::read(fds[0], tmp, std::min<unsigned long>(left, sizeof(tmp)));
+        if (m < 0 && errno == EINTR)
+            continue;
+        if (m <= 0) {
+            broken = true;
+            break;
+        }
+        IoBackend::get().pwrite(fd, tmp, m, off);
+        off = off + m;
+        left = left - m;
+    }
+    queued -= n;
+    full = false;
+    return left == 0;
+}
 
 class TcpSocket {
 public:
@@ -26,19 +210,77 @@ public:
     const uint16_t getport() const;
     void setPort(uint16_t);
     int getSocketFd() const;
+    // Unique for the life of the process, unlike the address of the socket.
+    uint64_t getId() const;
+    // Shared with the disk jobs that write what the socket received.
+    const std::shared_ptr<DiskBacklog>& getDiskBacklog() const;
+    bool setNonBlocking();
 
     std::string read(unsigned long);
+    ssize_t read(char *buf, unsigned long n);
+    template<typename Buffer>
+    ssize_t readInto(Buffer& buffer);
+    // Sends the head of the outbound queue and reads into the buffer with a
+    // single submit to the I/O backend. Send errors are left to flush().
+    template<typename Buffer>
+    ssize_t flushAndReadInto(Buffer& buffer);
+    ssize_t spliceTo(SplicePipe& pipe, unsigned long n, bool &spliced);
     ssize_t write(const std::string& header);
     ssize_t write(const std::string& header, const std::string& body);
+    ssize_t write(const std::vector<TcpFrame>& frames);
+    ssize_t write(const std::string& header, const std::shared_ptr<File>& file, off_t offset, unsigned long length);
     bool shutdown();
     bool close();
+
+    // Once a notifier is set, write() only queues the frame and the owner of
+    // the socket drains the queue with flush() on its I/O thread. After
+    // clearOutbound() every write() fails.
+    void setWriteNotifier(std::function<void()> notifier);
+    void setOutboundLimit(unsigned long limit);
+    bool flush();
+    void clearOutbound();
+    bool hasOutbound();
+    unsigned long getOutboundBytes();
+    bool isDropped();
+    void shutdownAfterFlush();
+    bool isShutdownPending();
+    // Marks that queued work waits for the outbound queue to drain, so the
+    // owner knows when a drain is worth reporting.
+    void setDrainWanted();
+    bool takeDrainWanted();
 private:
     int socketfd;
     char ip[20];
     uint16_t port;
+    uint64_t id;
+    std::shared_ptr<DiskBacklog> diskBacklog;
+
+    std::mutex outboundMutex;
+    std::deque<TcpFrame> outbound;
+    unsigned long outboundBytes;
+    unsigned long outboundOffset;
+    unsigned long outboundLimit;
+    bool notified;
+    bool dropped;
+    bool shutdownPending;
+    bool drainWanted;
+    bool outboundClosed;
+    std::function<void()> writeNotifier;
+
+    static const int FLUSHIOVNUM = 64;
+
+    static uint64_t createId();
+    static void advance(iovec *&iov, int &iovcnt, unsigned long len);
+    int gatherOutbound(iovec *iovs, iovec *&iov);
+    void consumeOutbound(unsigned long len);
+    bool writeAll(iovec *iov, int iovcnt);
+    ssize_t sendFile(const TcpFrame& frame, unsigned long sent);
+    bool sendFileAll(const TcpFrame& frame);
+    ssize_t enqueue(TcpFrame &&frame);
+    void popOutbound();
 };
 
-TcpSocket::TcpSocket(int fd, char *i, uint16_t p) : socketfd(fd), port(p) {
+TcpSocket::TcpSocket(int fd, char *i, uint16_t p) : socketfd(fd), port(p), id(createId()), diskBacklog(std::make_shared<DiskBacklog>()), outboundBytes(0), outboundOffset(0), outboundLimit(0), notified(false), dropped(false), shutdownPending(false), drainWanted(false), outboundClosed(false) {
     strcpy(ip, i);
 }
 
@@ -46,9 +288,11 @@ TcpSocket::~TcpSocket() {
     close();
 }
 
-TcpSocket::TcpSocket(TcpSocket&& r) noexcept : socketfd(r.socketfd), port(r.port) {
+TcpSocket::TcpSocket(TcpSocket&& r) noexcept : socketfd(r.socketfd), port(r.port), id(r.id), diskBacklog(std::move(r.diskBacklog)), outbound(std::move(r.outbound)), outboundBytes(r.outboundBytes), outboundOffset(r.outboundOffset), outboundLimit(r.outboundLimit), notified(false), dropped(r.dropped), shutdownPending(r.shutdownPending), drainWanted(r.drainWanted), outboundClosed(r.outboundClosed) {
     strcpy(ip, r.ip);
     r.socketfd = -1;
+    r.outboundBytes = 0;
+    r.outboundOffset = 0;
 }
 
 TcpSocket& TcpSocket::operator=(TcpSocket&& r) noexcept {
@@ -56,7 +300,19 @@ TcpSocket& TcpSocket::operator=(TcpSocket&& r) noexcept {
     socketfd = r.socketfd;
     strcpy(ip, r.ip);
     port = r.port;
+    id = r.id;
+    diskBacklog = std::move(r.diskBacklog);
+    outbound = std::move(r.outbound);
+    outboundBytes = r.outboundBytes;
+    outboundOffset = r.outboundOffset;
+    outboundLimit = r.outboundLimit;
+    dropped = r.dropped;
+    shutdownPending = r.shutdownPending;
+    drainWanted = r.drainWanted;
+    outboundClosed = r.outboundClosed;
     r.socketfd = -1;
+    r.outboundBytes = 0;
+    r.outboundOffset = 0;
     return *this;
 }
 
@@ -80,30 +336,374 @@ int TcpSocket::getSocketFd() const {
     return socketfd;
 }
 
+uint64_t TcpSocket::getId() const {
+    return id;
+}
+
+const std::shared_ptr<DiskBacklog>& TcpSocket::getDiskBacklog() const {
+    return diskBacklog;
+}
+
+uint64_t TcpSocket::createId() {
+    static std::atomic<uint64_t> next(1);
+    return next++;
+}
+
+bool TcpSocket::setNonBlocking() {
+    int flags = ::fcntl(socketfd, F_GETFL, 0);
+    if (flags == -1)
+        return false;
+    return ::fcntl(socketfd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
 std::string TcpSocket::read(unsigned long n) {
     char *buf = new char[n];
-    unsigned long len = ::read(socketfd, buf, n);
-    std::string ret(buf, len);
+    ssize_t len = ::read(socketfd, buf, n);
+    std::string ret(buf, len > 0 ? len : 0);
     delete[] buf;
     return ret;
 }
 
+ssize_t TcpSocket::read(char *buf, unsigned long n) {
+    ssize_t len;
+    do {
+        len = IoBackend::get().recv(socketfd, buf, n);
+    } while (len < 0 && errno == EINTR);
+    return len;
+}
+
+void TcpSocket::advance(iovec *&iov, int &iovcnt, unsigned long len) {
+    while (iovcnt > 0 && len >= iov->iov_len) {
+        len = len - iov->iov_len;
+        ++iov;
+        --iovcnt;
+    }
+    if (iovcnt > 0) {
+        iov->iov_base = static_cast<char*>(iov->iov_base) + len;
+        iov->iov_len = iov->iov_len - len;
+    }
+}
+
+template<typename Buffer>
+ssize_t TcpSocket::readInto(Buffer& buffer) {
+    iovec iov[2];
+    int iovcnt = buffer.getWritableSegments(iov);
+    if (iovcnt == 0)
+        return 0;
+    ssize_t len;
+    do {
+        len = IoBackend::get().recvv(socketfd, iov, iovcnt);
+    } while (len < 0 && errno == EINTR);
+    if (len > 0)
+        buffer.commitWrite(len);
+    return len;
+}
+
+template<typename Buffer>
+ssize_t TcpSocket::flushAndReadInto(Buffer& buffer) {
+    std::unique_lock<std::mutex> lock(outboundMutex);
+    if (outbound.empty() || outboundOffset >= outbound.front().getMemorySize()) {
+        lock.unlock();
+        return readInto(buffer);
+    }
+    iovec recvIov[2];
+    int recvIovcnt = buffer.getWritableSegments(recvIov);
+    if (recvIovcnt == 0)
+        return 0;
+    iovec iovs[FLUSHIOVNUM];
+    iovec *iov;
+    int iovcnt = gatherOutbound(iovs, iov);
+    IoRequest requests[2] = {IoRequest(IoRequest::SENDMSG, socketfd, iov, iovcnt, -1), IoRequest(IoRequest::RECVMSG, socketfd, recvIov, recvIovcnt, -1)};
+    IoBackend::get().submit(requests, 2);
+    if (requests[0].result > 0)
+        consumeOutbound(requests[0].result);
+    lock.unlock();
+    if (requests[1].result == -EINTR)
+        return readInto(buffer);
+    if (requests[1].result < 0) {
+        errno = -requests[1].result;
+        return -1;
+    }
+    if (requests[1].result > 0)
+        buffer.commitWrite(requests[1].result);
+    return requests[1].result;
+}
+
+// Moves up to n bytes from the socket into the pipe. A socket that refuses
+// splice() clears spliced so the caller stops trying. EAGAIN while the
+// socket still has bytes means the pipe ran out of slots.
+ssize_t TcpSocket::spliceTo(SplicePipe &pipe, unsigned long n, bool &spliced) {
+    ssize_t len;
+    do {
+        len = ::splice(socketfd, nullptr, pipe.getWriteFd(), nullptr, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (len < 0 && errno == EINTR);
+    if (len < 0 && errno == EINVAL) {
+        spliced = false;
+        errno = EAGAIN;
+    }
+    if (len < 0 && errno == EAGAIN && pipe.getFree() < pipe.getSize()) {
+        int available = 0;
+        if (::ioctl(socketfd, FIONREAD, &available) == 0 && available > 0)
+            pipe.setFull();
+        errno = EAGAIN;
+    }
+    if (len > 0)
+        pipe.commitFill(len);
+    return len;
+}
+
+bool TcpSocket::writeAll(iovec *iov, int iovcnt) {
+    advance(iov, iovcnt, 0);
+    while (iovcnt > 0) {
+        ssize_t len = IoBackend::get().sendv(socketfd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            pollfd pfd = {socketfd, POLLOUT, 0};
+            ::poll(&pfd, 1, -1);
+            continue;
+        }
+        advance(iov, iovcnt, len);
+    }
+    return true;
+}
+
 ssize_t TcpSocket::write(const std::string& header) {
-    uint32_t len = sizeof(uint16_t) + header.size();
-    uint16_t headerLen = header.size();
-    ::write(socketfd, (void*)&len, sizeof(uint32_t));
-    ::write(socketfd, (void*)&headerLen, sizeof(uint16_t));
-    return ::write(socketfd, header.data(), header.size()) + sizeof(uint16_t) + sizeof(uint32_t);
+    return write(header, std::string());
 }
 
 ssize_t TcpSocket::write(const std::string& header, const std::string& body) {
+    {
+        std::unique_lock<std::mutex> lock(outboundMutex);
+        if (outboundClosed)
+            return -1;
+        if (writeNotifier)
+            return enqueue(TcpFrame(header, body));
+    }
     uint32_t len = sizeof(uint16_t) + header.size() + body.size();
     uint16_t headerLen = header.size();
-    ::write(socketfd, (void*)&len, sizeof(uint32_t));
-    ::write(socketfd, (void*)&headerLen, sizeof(uint16_t));
-    ssize_t ret1 = ::write(socketfd, header.data(), header.size());
-    ssize_t ret2 = ::write(socketfd, body.data(), body.size());
-    return ret1 + ret2 + sizeof(uint16_t) + sizeof(uint32_t);
+    iovec iov[4] = {
+        {&len, sizeof(uint32_t)},
+        {&headerLen, sizeof(uint16_t)},
+        {const_cast<char*>(header.data()), header.size()},
+        {const_cast<char*>(body.data()), body.size()}
+    };
+    if (!writeAll(iov, 4))
+        return -1;
+    return header.size() + body.size() + sizeof(uint16_t) + sizeof(uint32_t);
+}
+
+ssize_t TcpSocket::write(const std::vector<TcpFrame>& frames) {
+    {
+        std::unique_lock<std::mutex> lock(outboundMutex);
+        if (outboundClosed)
+            return -1;
+        if (writeNotifier) {
+            ssize_t ret = 0;
+            for (const auto& frame : frames) {
+                ssize_t len = enqueue(TcpFrame(frame));
+                if (len < 0)
+                    return -1;
+                ret += len;
+            }
+            return ret;
+        }
+    }
+    std::vector<iovec> iov(frames.size() * 3);
+    int iovcnt = 0;
+    ssize_t ret = 0;
+    for (const auto& frame : frames) {
+        iovcnt += frame.getIovecs(iov.data() + iovcnt);
+        ret += frame.getSize();
+        if (frame.fileLength == 0)
+            continue;
+        if (!writeAll(iov.data(), iovcnt) || !sendFileAll(frame))
+            return -1;
+        iovcnt = 0;
+    }
+    if (!writeAll(iov.data(), iovcnt))
+        return -1;
+    return ret;
+}
+
+ssize_t TcpSocket::write(const std::string& header, const std::shared_ptr<File>& file, off_t offset, unsigned long length) {
+    std::vector<TcpFrame> frames;
+    frames.emplace_back(header, file, offset, length);
+    return write(frames);
+}
+
+ssize_t TcpSocket::sendFile(const TcpFrame& frame, unsigned long sent) {
+    off_t offset = frame.fileOffset + sent;
+    ssize_t len;
+    do {
+        len = ::sendfile(socketfd, frame.file->getFd(), &offset, frame.fileLength - sent);
+    } while (len < 0 && errno == EINTR);
+    // The file shrank under us, the frame can never be completed.
+    if (len == 0) {
+        errno = EIO;
+        return -1;
+    }
+    return len;
+}
+
+bool TcpSocket::sendFileAll(const TcpFrame& frame) {
+    unsigned long sent = 0;
+    while (sent < frame.fileLength) {
+        ssize_t len = sendFile(frame, sent);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            pollfd pfd = {socketfd, POLLOUT, 0};
+            ::poll(&pfd, 1, -1);
+            continue;
+        }
+        sent += len;
+    }
+    return true;
+}
+
+ssize_t TcpSocket::enqueue(TcpFrame &&frame) {
+    if (socketfd < 0 || dropped || shutdownPending)
+        return -1;
+    unsigned long size = frame.getSize();
+    if (outboundLimit > 0 && outboundBytes + size > outboundLimit) {
+        dropped = true;
+        ++Stats::get().droppedClients;
+    } else {
+        outbound.push_back(std::move(frame));
+        outboundBytes += size;
+        Stats::get().outboundBytes += size;
+        ++Stats::get().outboundFrames;
+        Stats::get().updateMax(Stats::get().outboundHighWaterBytes, outboundBytes);
+    }
+    if (!notified) {
+        notified = true;
+        writeNotifier();
+    }
+    return dropped ? -1 : size;
+}
+
+void TcpSocket::popOutbound() {
+    unsigned long size = outbound.front().getSize();
+    outbound.pop_front();
+    outboundBytes -= size;
+    Stats::get().outboundBytes -= size;
+    --Stats::get().outboundFrames;
+}
+
+void TcpSocket::setWriteNotifier(std::function<void()> notifier) {
+    std::unique_lock<std::mutex> lock(outboundMutex);
+    writeNotifier = std::move(notifier);
+}
+
+void TcpSocket::setOutboundLimit(unsigned long limit) {
+    std::unique_lock<std::mutex> lock(outboundMutex);
+    outboundLimit = limit;
+}
+
+bool TcpSocket::flush() {
+    std::unique_lock<std::mutex> lock(outboundMutex);
+    notified = false;
+    while (!outbound.empty()) {
+        const TcpFrame& front = outbound.front();
+        ssize_t len;
+        if (outboundOffset >= front.getMemorySize()) {
+            len = sendFile(front, outboundOffset - front.getMemorySize());
+        } else {
+            iovec iovs[FLUSHIOVNUM];
+            iovec *iov;
+            int iovcnt = gatherOutbound(iovs, iov);
+            len = IoBackend::get().sendv(socketfd, iov, iovcnt);
+        }
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        consumeOutbound(len);
+    }
+    return true;
+}
+
+// Gathers in-memory parts up to and including the first frame whose body has
+// to follow by sendfile(). Called with outboundMutex held.
+int TcpSocket::gatherOutbound(iovec *iovs, iovec *&iov) {
+    iov = iovs;
+    int iovcnt = 0;
+    for (auto iter = outbound.begin(); iter != outbound.end() && iovcnt + 3 <= FLUSHIOVNUM; ++iter) {
+        iovcnt += iter->getIovecs(iovs + iovcnt);
+        if (iter->fileLength > 0)
+            break;
+    }
+    advance(iov, iovcnt, outboundOffset);
+    return iovcnt;
+}
+
+void TcpSocket::consumeOutbound(unsigned long len) {
+    outboundOffset += len;
+    while (!outbound.empty() && outboundOffset >= outbound.front().getSize()) {
+        outboundOffset -= outbound.front().getSize();
+        popOutbound();
+    }
+}
+
+void TcpSocket::clearOutbound() {
+    std::unique_lock<std::mutex> lock(outboundMutex);
+    while (!outbound.empty())
+        popOutbound();
+    outboundOffset = 0;
+    outboundClosed = true;
+    writeNotifier = nullptr;
+}
+
+bool TcpSocket::hasOutbound() {
+    std::unique_lock<std::mutex> lock(outboundMutex);
+    return !outbound.empty();
+}
+
+unsigned long TcpSocket::getOutboundBytes() {
+    std::unique_lock<std::mutex> lock(outboundMutex);
+    return outboundBytes;
+}
+
+bool TcpSocket::isDropped() {
+    std::unique_lock<std::mutex> lock(outboundMutex);
+    return dropped;
+}
+
+void TcpSocket::shutdownAfterFlush() {
+    std::unique_lock<std::mutex> lock(outboundMutex);
+    if (outboundClosed)
+        return;
+    if (!writeNotifier) {
+        lock.unlock();
+        shutdown();
+        return;
+    }
+    shutdownPending = true;
+    if (!notified) {
+        notified = true;
+        writeNotifier();
+    }
+}
+
+bool TcpSocket::isShutdownPending() {
+    std::unique_lock<std::mutex> lock(outboundMutex);
+    return shutdownPending;
+}
+
+void TcpSocket::setDrainWanted() {
+    std::unique_lock<std::mutex> lock(outboundMutex);
+    drainWanted = true;
+}
+
+bool TcpSocket::takeDrainWanted() {
+    std::unique_lock<std::mutex> lock(outboundMutex);
+    bool ret = drainWanted;
+    drainWanted = false;
+    return ret;
 }
 
 bool TcpSocket::shutdown() {
@@ -113,9 +713,13 @@ bool TcpSocket::shutdown() {
 }
 
 bool TcpSocket::close() {
+    std::unique_lock<std::mutex> lock(outboundMutex);
     if (socketfd < 0)
         return true;
-    return ::close(socketfd) != -1;
+    bool ret = ::close(socketfd) != -1;
+    socketfd = -1;
+    outboundClosed = true;
+    return ret;
 }
 
 class TcpServer {
@@ -136,6 +740,11 @@ public:
     uint32_t getHost();
     void setMaxClientNum(int maxClientNum);
     int getMaxClientNum();
+    void setReusePort(bool reusePort);
+    bool getReusePort();
+    void setNonBlocking(bool nonBlocking);
+    bool getNonBlocking();
+    int getSocketFd() const;
     bool open();
     bool bind();
     bool listen();
@@ -146,16 +755,15 @@ private:
     uint16_t port;
     u_int32_t host;
     int maxClientNum;
-    std::vector<TcpSocket*> clients;
+    bool reusePort;
+    bool nonBlocking;
 };
 
-TcpServer::TcpServer() : socketfd(-1), port(0), host(0), maxClientNum(0) {}
+TcpServer::TcpServer() : socketfd(-1), port(0), host(0), maxClientNum(0), reusePort(false), nonBlocking(false) {}
 
-TcpServer::TcpServer(uint32_t host, uint16_t port, int maxClientNum) : socketfd(-1), port(port), host(host), maxClientNum(maxClientNum) {}
+TcpServer::TcpServer(uint32_t host, uint16_t port, int maxClientNum) : socketfd(-1), port(port), host(host), maxClientNum(maxClientNum), reusePort(false), nonBlocking(false) {}
 
 TcpServer::~TcpServer() {
-    for (auto& client : clients)
-        delete client;
     close();
 }
 
@@ -183,9 +791,37 @@ int TcpServer::getMaxClientNum() {
     return maxClientNum;
 }
 
+void TcpServer::setReusePort(bool reusePort) {
+    this->reusePort = reusePort;
+}
+
+bool TcpServer::getReusePort() {
+    return reusePort;
+}
+
+void TcpServer::setNonBlocking(bool nonBlocking) {
+    this->nonBlocking = nonBlocking;
+}
+
+bool TcpServer::getNonBlocking() {
+    return nonBlocking;
+}
+
+int TcpServer::getSocketFd() const {
+    return socketfd;
+}
+
 bool TcpServer::open() {
-    socketfd = ::socket(AF_INET, SOCK_STREAM, 0);
-    return socketfd >= 0;
+    socketfd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | (nonBlocking ? SOCK_NONBLOCK : 0), 0);
+    if (socketfd < 0)
+        return false;
+    int on = 1;
+    if (::setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+        (reusePort && ::setsockopt(socketfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)) {
+        close();
+        return false;
+    }
+    return true;
 }
 
 bool TcpServer::bind() {
@@ -203,20 +839,20 @@ bool TcpServer::listen() {
 bool TcpServer::close() {
     if (socketfd < 0)
         return true;
-    return ::close(socketfd) != -1;
+    bool ret = ::close(socketfd) != -1;
+    socketfd = -1;
+    return ret;
 }
 
 TcpSocket *TcpServer::accept() {
     sockaddr_in clientAddr;
     socklen_t len = sizeof(clientAddr);
-    int clientfd = ::accept(socketfd, (sockaddr*)&clientAddr, &len);
+    int clientfd = ::accept4(socketfd, (sockaddr*)&clientAddr, &len, SOCK_CLOEXEC | (nonBlocking ? SOCK_NONBLOCK : 0));
     if (clientfd < 0)
         return nullptr;
     char ip[20];
     inet_ntop(AF_INET, &clientAddr.sin_addr.s_addr, ip, sizeof(ip));
-    TcpSocket *client = new TcpSocket(clientfd, ip, ntohs(clientAddr.sin_port));
-    clients.push_back(client);
-    return client;
+    return new TcpSocket(clientfd, ip, ntohs(clientAddr.sin_port));
 }
 
 #endif //SERVER_TCP_H
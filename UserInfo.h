@@ -19,8 +19,8 @@ void deserialize(std::ifstream& in, std::string& str) {
     in.read((char*)&size, sizeof(size_t));
     char *tmp = new char[size];
     in.read(tmp, size);
-    str = std::string(tmp);
-    delete tmp;
+    str = std::string(tmp, size);
+    delete[] tmp;
 }
 
 void serialize(std::ofstream& out, const int64_t& i) {
@@ -67,6 +67,9 @@ struct FileInfo {
     std::string uuid;
     int64_t time;
     int64_t fsize;
+    int64_t received; // bytes uploaded from the start, kept across reconnects
+    std::string hash; // content hash once the file is in the store
+    int64_t crc; // CRC32C of the uploaded bytes, -1 until the upload ends
 
     FileInfo();
     FileInfo(const std::string& u, int64_t s, const std::string& f, const std::string& uu, int64_t t);
@@ -75,9 +78,9 @@ struct FileInfo {
     void deserialize(std::ifstream& in);
 };
 
-FileInfo::FileInfo() : object(), size(0), filename(), uuid(), time(0), fsize(-1) {}
+FileInfo::FileInfo() : object(), size(0), filename(), uuid(), time(0), fsize(-1), received(0), crc(-1) {}
 
-FileInfo::FileInfo(const std::string& ou, int64_t s, const std::string& f, const std::string& u, int64_t t) : subject(), object(ou), size(s), filename(f), uuid(u), time(t), fsize(-1) {}
+FileInfo::FileInfo(const std::string& ou, int64_t s, const std::string& f, const std::string& u, int64_t t) : subject(), object(ou), size(s), filename(f), uuid(u), time(t), fsize(-1), received(0), crc(-1) {}
 
 void FileInfo::serialize(std::ofstream& out) const {
     ::serialize(out, object);
@@ -1,12 +1,19 @@
 #include <cstdio>
 #include <cstdlib>
 #include <iostream>
+#include <memory>
 #include <thread>
+#include <vector>
 
 #include <set>
 
 #include "Constant.h"
+#include "Acceptor.h"
 #include "Controller.h"
+#include "DiskPool.h"
+#include "EventLoop.h"
+#include "IoBackend.h"
+#include "Stats.h"
 #include "Timer.h"
 
 using namespace std;
@@ -14,26 +21,55 @@ using namespace std;
 int main() {
     fprintf(stderr, "Start server.\n");
 
-    TcpServer tcpServer(INADDR_ANY, PORT, MAXCLIENTNUM);
     Controller controller;
+    EventLoopPool loops(EVENTLOOPNUM);
+    unsigned int listenerNum = REUSEPORTLISTENERS ? loops.getLoopNum() : 1;
+    vector<unique_ptr<TcpServer>> tcpServers;
+    vector<unique_ptr<Acceptor>> acceptors;
 
-    if (!tcpServer.open()) {
-        fprintf(stderr, "Error: can't open tcp server.\n");
+    if (!loops.isOpen()) {
+        fprintf(stderr, "Error: can't create event loops.\n");
         exit(1);
     }
-    fprintf(stderr, "Open server socket successfully.\n");
 
-    if (!tcpServer.bind()) {
-        fprintf(stderr, "Error: can't bind server socket with address.\n");
-        exit(1);
-    }
-    fprintf(stderr, "Bind server socket with address successfully.\n");
+    for (unsigned int i = 0; i < listenerNum; ++i) {
+        unique_ptr<TcpServer> tcpServer(new TcpServer(INADDR_ANY, PORT, MAXCLIENTNUM));
+        tcpServer->setReusePort(REUSEPORTLISTENERS);
+        tcpServer->setNonBlocking(true);
 
-    if (!tcpServer.listen()) {
-        fprintf(stderr, "Error: can't listen the address.\n");
-        exit(1);
+        if (!tcpServer->open()) {
+            fprintf(stderr, "Error: can't open tcp server.\n");
+            exit(1);
+        }
+
+        if (!tcpServer->bind()) {
+            fprintf(stderr, "Error: can't bind server socket with address.\n");
+            exit(1);
+        }
+
+        if (!tcpServer->listen()) {
+            fprintf(stderr, "Error: can't listen the address.\n");
+            exit(1);
+        }
+
+        EventLoop *loop = loops.getLoop(i);
+        unique_ptr<Acceptor> acceptor(new Acceptor(tcpServer.get(), loop, REUSEPORTLISTENERS ? nullptr : &loops, controller));
+        if (!acceptor->start()) {
+            fprintf(stderr, "Error: can't watch server socket.\n");
+            exit(1);
+        }
+        tcpServers.push_back(move(tcpServer));
+        acceptors.push_back(move(acceptor));
     }
-    fprintf(stderr, "Listen the port: %u successfully.\n", tcpServer.getPort());
+    fprintf(stderr, "Listen the port: %u with %u listeners successfully.\n", PORT, listenerNum);
+
+    if (IoBackend::select(USEIOURING ? IoBackend::URING : IoBackend::BLOCKING) == IoBackend::URING)
+        fprintf(stderr, "Use io_uring I/O backend.\n");
+    else
+        fprintf(stderr, "Use blocking I/O backend.\n");
+
+    DiskPool::get().start(DISKTHREADNUM);
+    fprintf(stderr, "Start %u disk threads.\n", DiskPool::get().getThreadNum());
 
     thread timer([&controller]() {
         Timer timer;
@@ -45,33 +81,17 @@ int main() {
     });
     timer.detach();
 
-    while (true) {
-        TcpSocket *client = tcpServer.accept();
-        if (client == nullptr) {
-            fprintf(stderr, "Error: can't accept the connect request.\n");
-            exit(1);
-        }
-
-        thread t([client, &controller]() {
-            fprintf(stderr, "Connect to client %s:%u, client socket fd: %d\n", client->getIP(), client->getport(), client->getSocketFd());
-            ReadRingBuffer<131072> buffer;
-            while (true) {
-                if (Controller::havaEntireRequest(buffer)) {
-                    controller.handleEntireRequest(buffer, client);
-                } else {
-                    string data = client->read(buffer.getCapacity());
-                    if (data.empty()) {
-                        controller.handleClientClose(client);
-                        fprintf(stderr, "Client disconnected.\n");
-                        close(client->getSocketFd());
-                        break;
-                    }
-                    buffer.putString(data);
-                }
-            }
+    thread statsTimer([]() {
+        Timer timer;
+        timer.start(STATSINTERVAL, []() {
+            fprintf(stderr, "stats  %s\n", Stats::get().toString().c_str());
         });
-        t.detach();
-    }
+    });
+    statsTimer.detach();
+
+    loops.start();
+    fprintf(stderr, "Start %u event loops successfully.\n", loops.getLoopNum());
+    loops.join();
 
     return 0;
 }